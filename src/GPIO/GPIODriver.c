@@ -100,6 +100,49 @@ void GPIO_pin_mode(PIN pin, PIN_MODE mode)
 	close(gpio_mode_file);
 }
 
+/**
+ * Set which signal edges on an input GPIO wake up a poll on its value file
+ * @param pin the GPIO pin number
+ * @param edge the edge type that triggers an interrupt
+ */
+void GPIO_set_edge(PIN pin, GPIO_EDGE edge)
+{
+	char gpio_edge_filename[35];
+	snprintf(gpio_edge_filename, 35, "%s%d/edge", GPIO_DIRECTORY_PREFIX, pin);
+
+	int gpio_edge_file = open(gpio_edge_filename, O_WRONLY | O_SYNC);
+	if(gpio_edge_file < 0)
+	{
+		ERROR_PRINTLN("Unable to open edge set file");
+		return;
+	}
+
+	int err = 0;
+
+	switch(edge)
+	{
+		case GPIO_EDGE_NONE:
+			err = write(gpio_edge_file, "none", 4);
+			break;
+		case GPIO_EDGE_RISING:
+			err = write(gpio_edge_file, "rising", 6);
+			break;
+		case GPIO_EDGE_FALLING:
+			err = write(gpio_edge_file, "falling", 7);
+			break;
+		case GPIO_EDGE_BOTH:
+			err = write(gpio_edge_file, "both", 4);
+			break;
+		default:
+			ERROR_PRINTLN("Edge type not implemented");
+			break;
+	}
+
+	if(err < 0) { ERROR_PRINTLN("Unable to set edge"); }
+
+	close(gpio_edge_file);
+}
+
 /**
  * Set a GPIO high or low
  * @param pin the gpio pin number
@@ -44,10 +44,20 @@ typedef enum
 	PIN_MODE_INVALID
 } PIN_MODE;
 
+typedef enum
+{
+	GPIO_EDGE_NONE,
+	GPIO_EDGE_RISING,
+	GPIO_EDGE_FALLING,
+	GPIO_EDGE_BOTH,
+	GPIO_EDGE_INVALID
+} GPIO_EDGE;
+
 typedef int PIN;
 
 void	   GPIO_init(PIN pin);
 void	   GPIO_pin_mode(PIN pin, PIN_MODE mode);
+void	   GPIO_set_edge(PIN pin, GPIO_EDGE edge);
 void	   GPIO_digital_write(PIN pin, GPIO_LEVEL val);
 GPIO_LEVEL GPIO_digital_read(PIN pin);
 int		   GPIO_get_pin_value_file_pointer(PIN pin, int * fp);
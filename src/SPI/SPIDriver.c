@@ -29,6 +29,7 @@
 
 #include <fcntl.h>
 #include <unistd.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <linux/types.h>
 #include <linux/spi/spidev.h>
@@ -40,6 +41,19 @@
 static int spi_file;
 char	   spi_filename[20];
 
+// Every chip select opened on the bus, the selected one is spi_file
+static int			spi_files[SPI_MAX_DEVICES];
+static unsigned int spi_chip_selects[SPI_MAX_DEVICES];
+static unsigned int spi_device_count = 0;
+static unsigned int spi_bus_number;
+static unsigned int spi_frequency;
+
+// The most bytes spidev moves in one direction per message, set by its bufsiz module parameter
+static const char * spi_buffer_size_path = "/sys/module/spidev/parameters/bufsiz";
+static unsigned int spi_buffer_size		 = 4096;
+
+static int openDevice(unsigned int spi_cs);
+
 char tx_buf[256];
 char rx_buf[256];
 
@@ -51,36 +65,105 @@ struct spi_ioc_transfer xfer;
  * @param frequency The clock frequency in Hz
  */
 void SPI_init(unsigned int spi_bus, unsigned int spi_cs, unsigned int frequency)
+{
+	spi_bus_number	 = spi_bus;
+	spi_frequency	 = frequency;
+	spi_device_count = 0;
+
+	xfer.tx_buf		   = (unsigned long) tx_buf;
+	xfer.rx_buf		   = (unsigned long) rx_buf;
+	xfer.delay_usecs   = 0;
+	xfer.speed_hz	   = frequency;
+	xfer.bits_per_word = 8;
+
+	FILE * buffer_size_file = fopen(spi_buffer_size_path, "r");
+
+	if(buffer_size_file != NULL)
+	{
+		if(fscanf(buffer_size_file, "%u", &spi_buffer_size) != 1 || spi_buffer_size == 0)
+		{
+			spi_buffer_size = 4096;
+		}
+
+		fclose(buffer_size_file);
+	}
+
+	spi_file = openDevice(spi_cs);
+
+	spi_files[0]		= spi_file;
+	spi_chip_selects[0] = spi_cs;
+	spi_device_count	= 1;
+}
+
+/**
+ * Open another chip select on the bus given to SPI_init(), for more devices sharing the clock and
+ * data lines. The selected device does not change.
+ * @param spi_cs The chip select number
+ * @return the device index to pass to SPI_select(), or -1 on failure
+ */
+int SPI_add_device(unsigned int spi_cs)
+{
+	for(unsigned int device = 0; device < spi_device_count; device++)
+	{
+		if(spi_chip_selects[device] == spi_cs) { return spi_files[device] < 0 ? -1 : device; }
+	}
+
+	if(spi_device_count == SPI_MAX_DEVICES)
+	{
+		ERROR_PRINTLN("No room for chip select %u on the SPI bus", spi_cs);
+		return -1;
+	}
+
+	int file = openDevice(spi_cs);
+	if(file < 0) { return -1; }
+
+	spi_files[spi_device_count]		   = file;
+	spi_chip_selects[spi_device_count] = spi_cs;
+
+	return spi_device_count++;
+}
+
+/**
+ * Direct the following transfers at one of the devices on the bus
+ * @param device The index from SPI_add_device(), 0 for the device given to SPI_init()
+ */
+void SPI_select(int device)
+{
+	if(device >= 0 && (unsigned int) device < spi_device_count) { spi_file = spi_files[device]; }
+}
+
+/**
+ * Open and configure one chip select of the bus
+ * @param spi_cs The chip select number
+ * @return the open device file, or -1 if it does not exist
+ */
+static int openDevice(unsigned int spi_cs)
 {
 	__u8 bits_per_word = 8;
 	__u8 mode		   = SPI_MODE_0;
 
-	snprintf(spi_filename, 19, "/dev/spidev%u.%u", spi_bus, spi_cs);
-	spi_file = open(spi_filename, O_RDWR);
+	snprintf(spi_filename, 19, "/dev/spidev%u.%u", spi_bus_number, spi_cs);
+	int file = open(spi_filename, O_RDWR);
 
-	if(spi_file < 0)
+	if(file < 0)
 	{
 		ERROR_PRINTLN("%19s does not exist.", spi_filename);
-		return;
+		return -1;
 	}
 
-	if(ioctl(spi_file, SPI_IOC_WR_MODE, &mode) < 0) { ERROR_PRINTLN("Cannot set mode %uh", mode); }
+	if(ioctl(file, SPI_IOC_WR_MODE, &mode) < 0) { ERROR_PRINTLN("Cannot set mode %uh", mode); }
 
-	if(ioctl(spi_file, SPI_IOC_WR_BITS_PER_WORD, &bits_per_word) < 0)
+	if(ioctl(file, SPI_IOC_WR_BITS_PER_WORD, &bits_per_word) < 0)
 	{
 		ERROR_PRINTLN("Cannot set %hu bits per word.", bits_per_word);
 	}
 
-	if(ioctl(spi_file, SPI_IOC_WR_MAX_SPEED_HZ, &frequency) < 0)
+	if(ioctl(file, SPI_IOC_WR_MAX_SPEED_HZ, &spi_frequency) < 0)
 	{
-		ERROR_PRINTLN("Cannot set max SPI speed of %u.", frequency);
+		ERROR_PRINTLN("Cannot set max SPI speed of %u.", spi_frequency);
 	}
 
-	xfer.tx_buf		   = (unsigned long) tx_buf;
-	xfer.rx_buf		   = (unsigned long) rx_buf;
-	xfer.delay_usecs   = 0;
-	xfer.speed_hz	   = frequency;
-	xfer.bits_per_word = bits_per_word;
+	return file;
 }
 
 /**
@@ -88,7 +171,16 @@ void SPI_init(unsigned int spi_bus, unsigned int spi_cs, unsigned int frequency)
  */
 void SPI_shutdown()
 {
-	if(close(spi_file) < 0) { ERROR_PRINTLN("SPI Bus close failure"); }
+	for(unsigned int device = 0; device < spi_device_count; device++)
+	{
+		if(spi_files[device] >= 0 && close(spi_files[device]) < 0)
+		{
+			ERROR_PRINTLN("SPI Bus close failure");
+		}
+	}
+
+	spi_device_count = 0;
+	spi_file		 = -1;
 }
 
 unsigned char SPI_transfer(unsigned char toSend)
@@ -136,4 +228,62 @@ unsigned short SPI_transfer16(unsigned short toSend)
 
 	unsigned short output = (((unsigned short) rx_buf[0]) << 8) | rx_buf[1];
 	return output;
-}
\ No newline at end of file
+}
+
+/**
+ * Send a command byte then read a block of data while chip select stays asserted. A block larger
+ * than the spidev buffer (4096 bytes unless spidev.bufsiz is raised) takes several messages, with
+ * chip select held between them, so no other device on the bus may be addressed until it returns.
+ * @param command the command byte that starts the read
+ * @param[out] data the buffer to read into
+ * @param length the number of bytes to read
+ * @return 0 on success or -1 on failure
+ */
+int SPI_burst_read(unsigned char command, unsigned char * data, unsigned int length)
+{
+	if(spi_file < 0)
+	{
+		ERROR_PRINTLN("SPI unavailable");
+		return -1;
+	}
+
+	struct spi_ioc_transfer burst[2];
+	unsigned int			offset = 0;
+
+	do
+	{
+		unsigned int chunk = length - offset < spi_buffer_size ? length - offset : spi_buffer_size;
+		int			 count = 0;
+
+		memset(burst, 0, sizeof(burst));
+
+		// Only the first message carries the command, the rest carry on clocking the same burst
+		if(offset == 0)
+		{
+			burst[count].tx_buf		   = (unsigned long) &command;
+			burst[count].len		   = 1;
+			burst[count].speed_hz	   = xfer.speed_hz;
+			burst[count].bits_per_word = xfer.bits_per_word;
+			count++;
+		}
+
+		burst[count].rx_buf		   = (unsigned long) (data + offset);
+		burst[count].len		   = chunk;
+		burst[count].speed_hz	   = xfer.speed_hz;
+		burst[count].bits_per_word = xfer.bits_per_word;
+
+		// On the last transfer of a message, cs_change keeps chip select asserted afterwards
+		burst[count].cs_change = offset + chunk < length;
+		count++;
+
+		if(ioctl(spi_file, SPI_IOC_MESSAGE(count), burst) < 0)
+		{
+			ERROR_PRINTLN("SPI %u byte burst read failed at byte %u", length, offset);
+			return -1;
+		}
+
+		offset += chunk;
+	} while(offset < length);
+
+	return 0;
+}
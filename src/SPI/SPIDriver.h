@@ -30,10 +30,15 @@
 #ifndef SPIDRIVER_H
 #define SPIDRIVER_H
 
+#define SPI_MAX_DEVICES 4
+
 void SPI_init(unsigned int spi_bus, unsigned int spi_cs, unsigned int frequency);
+int	 SPI_add_device(unsigned int spi_cs);
+void SPI_select(int device);
 void SPI_shutdown();
 
 unsigned char  SPI_transfer(unsigned char toSend);
 unsigned short SPI_transfer16(unsigned short toSend);
+int			   SPI_burst_read(unsigned char command, unsigned char * data, unsigned int length);
 
 #endif
\ No newline at end of file
@@ -37,6 +37,14 @@
 
 #include "Button.h"
 
+static const unsigned int button_debounce_ms = 50;
+
+static int				  button_idle_level	   = -1;
+static int				  button_current_level = -1;
+static unsigned long long button_last_press_ms = 0;
+
+static int readButtonLevel(int pin_value_file);
+
 /**
  * Initialize a button for reading
  * @param button_pin The GPIO pin number that the button is attached to
@@ -110,4 +118,94 @@ void Button_wait_for_press(PIN button_pin, unsigned int post_press_pause_time_ms
 	close(pin_value_file);
 
 	Timer_delay_ms(post_press_pause_time_ms);
-}
\ No newline at end of file
+}
+
+/**
+ * Open a pollable file descriptor that becomes ready with EPOLLPRI on every button edge
+ * @param button_pin The GPIO pin number that the button is attached to
+ * @return The file descriptor, or a negative value on failure
+ */
+int Button_open_event_fd(PIN button_pin)
+{
+	int pin_value_file;
+
+	GPIO_set_edge(button_pin, GPIO_EDGE_BOTH);
+
+	if(GPIO_get_pin_value_file_pointer(button_pin, &pin_value_file) < 0)
+	{
+		ERROR_PRINTLN("GPIO pin value file failed to open, cannot watch button events");
+		return -1;
+	}
+
+	// The level at open time is treated as released
+	button_idle_level	 = readButtonLevel(pin_value_file);
+	button_current_level = button_idle_level;
+	button_last_press_ms = 0;
+
+	DEBUG_PRINTLN("Watching button events, idle state is %d", button_idle_level);
+	return pin_value_file;
+}
+
+/**
+ * Consume a pending edge event on a button event file descriptor
+ * @param event_fd The descriptor from Button_open_event_fd
+ * @return 1 if the event was a debounced press, 0 otherwise
+ */
+int Button_handle_event(int event_fd)
+{
+	int new_level = readButtonLevel(event_fd);
+
+	if(new_level < 0 || new_level == button_current_level) { return 0; }
+
+	button_current_level = new_level;
+
+	if(new_level == button_idle_level) { return 0; }
+
+	unsigned long long now_ms = Timer_now_ms();
+
+	if(button_last_press_ms != 0 && now_ms - button_last_press_ms < button_debounce_ms)
+	{
+		return 0;
+	}
+
+	button_last_press_ms = now_ms;
+	DEBUG_PRINTLN("Button Pressed, changed to %d", new_level);
+	return 1;
+}
+
+/**
+ * Close a button event file descriptor
+ * @param event_fd The descriptor from Button_open_event_fd
+ */
+void Button_close_event_fd(int event_fd)
+{
+	if(event_fd >= 0) { close(event_fd); }
+}
+
+/**
+ * Read the current level from an open pin value file, which also acknowledges a pending edge
+ * @param pin_value_file The open GPIO value file
+ * @return 0 or 1 for the pin level, or -1 on failure
+ */
+static int readButtonLevel(int pin_value_file)
+{
+	char value_buffer[8];
+
+	lseek(pin_value_file, 0, SEEK_SET);
+
+	if(read(pin_value_file, value_buffer, sizeof(value_buffer)) < 0)
+	{
+		ERROR_PRINTLN("Unable to read value file");
+		return -1;
+	}
+
+	int level = value_buffer[0] - '0';
+
+	if(level != 0 && level != 1)
+	{
+		ERROR_PRINTLN("Pin value of %d is invalid", level);
+		return -1;
+	}
+
+	return level;
+}
@@ -34,4 +34,8 @@
 void Button_init(PIN button_pin);
 void Button_wait_for_press(PIN button_pin, unsigned int post_press_pause_time_ms);
 
+int	 Button_open_event_fd(PIN button_pin);
+int	 Button_handle_event(int event_fd);
+void Button_close_event_fd(int event_fd);
+
 #endif
\ No newline at end of file
@@ -28,18 +28,6 @@
 #ifndef __ARDUCAM_H
 #define __ARDUCAM_H
 
-#define JPEG_BUF_SIZE 2 * 1024 * 1024	 // 2M
-#define CMD_BUF_SIZE  512
-
-char readbuf[JPEG_BUF_SIZE];
-
-char * sendbuf_cam1;
-char * sendbuf_cam2;
-char * sendbuf_cam3;
-char * sendbuf_cam4;
-
-char revCmdData[CMD_BUF_SIZE];
-
 // ArduCAM CS define
 #define CAM_CS1 17
 #define CAM_CS2 23
@@ -28,11 +28,17 @@
  */
 
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "Debug.h"
 #include "I2CDriver.h"
 #include "SPIDriver.h"
 #include "Timer.h"
+#include "JPEG.h"
 
 #include "Camera.h"
 #include "ArduCAM.h"
@@ -40,11 +46,32 @@
 
 const unsigned char camera_i2c_address = 0x3C;
 
+// OV5642 system control register, bit 7 is software reset and bit 6 is software power down
+static const unsigned int  sensor_system_control_reg = 0x3008;
+static const unsigned char sensor_system_streaming	 = 0x02;
+static const unsigned char sensor_system_power_down	 = 0x42;
+static const unsigned int  sensor_wake_timeout_us	 = 100000;
+
+// OV5642 auto exposure readouts used to detect when exposure has settled
+static const unsigned int sensor_aec_exposure_reg = 0x3500;	   // 0x3500-0x3502, exposure[19:0]
+static const unsigned int sensor_agc_gain_reg	  = 0x350a;	   // 0x350a-0x350b, gain[9:0]
+static const unsigned int sensor_average_luma_reg = 0x56a1;
+static const unsigned int settle_poll_interval_ms = 33;
+static const unsigned int settle_stable_samples	  = 3;
+static const unsigned int settle_luma_tolerance	  = 2;
+static const unsigned int settle_gain_tolerance	  = 2;
+
+// Nominal OV5642 draw, not measured, used to turn standby residency into an estimated average
+// power figure
+static const unsigned int sensor_active_power_mw  = 250;
+static const unsigned int sensor_standby_power_mw = 1;
+
 void		  clearFIFOFlag();
 unsigned char readFIFO();
 void		  flushFIFO();
 unsigned int  readFIFOLength();
 void		  setFIFOBurst();
+int			  readFIFOBurst(unsigned char * buffer, unsigned int length);
 
 unsigned char readRegister(unsigned char address);
 void		  writeRegister(unsigned char address, unsigned char data);
@@ -66,67 +93,613 @@ void rdSensorReg16_8(unsigned int regID, unsigned char * regDat);
 void rdSensorRegs16_8(struct sensor_reg reglist[]);
 
 static IMAGE_TYPE format;
-char			  read_buffer[JPEG_BUFFER_SIZE];
-char			  command_buffer[CMD_BUFFER_SIZE];
-char *			  send_buffer;
 
-int current_jpeg_buffer_size;
+// Frame buffers sized for the current resolution, shared by every capture path
+#define FRAME_POOL_DEFAULT_SIZE 4
+static const unsigned int resolution_width[] = {
+	320, 640, 1024, 1280, 1600, 2048, 2592, 1280, 1920};
+static const unsigned int resolution_height[] = {
+	240, 480, 768, 960, 1200, 1536, 1944, 720, 1080};
+
+// Frame rate the video presets are paced to, 0 for still sizes which capture as fast as they can.
+// 1080p frames are over twice the size of 720p ones through the same SPI bus.
+static const unsigned int resolution_target_fps[] = {0, 0, 0, 0, 0, 0, 0, 30, 15};
+static FRAME_POOL *	frame_pool		= NULL;
+static unsigned int		frame_pool_size = FRAME_POOL_DEFAULT_SIZE;
+static CAMERA_FRAME *	capture_frame	= NULL;
+
+static FRAME_POOL * useFramePool(unsigned int count);
+
+static unsigned int settle_timeout_ms = 3000;
+
+static const unsigned int init_backoff_start_ms = 10;
+static const unsigned int init_backoff_max_ms	= 1000;
+
+static pthread_mutex_t	  init_lock		   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	  init_cond		   = PTHREAD_COND_INITIALIZER;
+static unsigned int		  init_deadline_ms = 5000;
+static unsigned long long init_start_ms;
+static bool				  init_reset_done;
+static CAMERA_INIT_STATUS init_status;
+
+static bool	  initBackoff(unsigned int * backoff_ms);
+static void * spiBringUpThread(void * arg);
+static void * i2cBringUpThread(void * arg);
+static void	  programSensorMinimal();
+
+// Shadow copy of every sensor register written since the last sensor reset
+#define SENSOR_REG_COUNT 0x10000
+static unsigned char sensor_shadow[SENSOR_REG_COUNT];
+static unsigned char sensor_shadow_valid[SENSOR_REG_COUNT / 8];
+
+// Sensor state checkpoint used to skip reprogramming after a process restart
+static const char		  checkpoint_magic[8]		= {'O', 'V', '5', '6', '4', '2', 'C', 'K'};
+static const unsigned int checkpoint_version		= 1;
+static const unsigned int checkpoint_sample_count	= 32;
+static const char *		  checkpoint_filename		= NULL;
+static struct sensor_reg * checkpoint_regs			= NULL;
+static unsigned int		  checkpoint_reg_count		= 0;
+static RESOLUTION		  checkpoint_resolution;
+static SPECIAL_EFFECTS	  checkpoint_effect;
+static bool				  sensor_restored			= false;
+
+static void shadowRecord(unsigned int regID, unsigned char regDat);
+static void shadowClear();
+static bool shadowIsVolatile(unsigned int regID);
+static bool shadowIsCommand(unsigned int regID);
+static bool shadowMatches(unsigned int regID, unsigned char regDat);
+static bool loadCheckpoint();
+static bool verifyCheckpoint();
+static void restoreCheckpoint();
+
+// Multi-frame streaming state
+#define SPI_BURST_CHUNK_SIZE 4096
+#define STREAM_MAX_FRAMES_PER_TRIGGER 7
+static CAMERA_FRAME **	stream_ring		   = NULL;
+static unsigned int		stream_ring_size   = 0;
+static unsigned int		stream_ring_head   = 0;
+static unsigned int		stream_ring_count  = 0;
+static unsigned int		stream_frames_per_trigger;
+static unsigned char *	stream_staging	   = NULL;
+static unsigned int		stream_staging_size;
+static unsigned long	stream_sequence;
+static unsigned long	stream_dropped;
+
+// Double buffered capture engine state
+static bool				  pipeline_running = false;
+static unsigned long	  pipeline_sequence;
+static unsigned long long pipeline_last_frame_us;
+static unsigned int		  pipeline_interval_us	   = 0;
+static bool				  pipeline_trigger_pending = false;
+
+static void triggerPaced();
+
+// Full resolution snapshot state, the registers the capture table changes are saved here so the
+// streaming setup can be put back with only the registers that differ
+#define SNAPSHOT_POOL_SIZE	   2
+#define SNAPSHOT_MAX_REGISTERS 128
+#define SNAPSHOT_ATTEMPTS	   3
+static FRAME_POOL *			 snapshot_pool = NULL;
+static struct sensor_reg	 snapshot_saved[SNAPSHOT_MAX_REGISTERS];
+static unsigned int			 snapshot_saved_count;
+static bool					 snapshot_gap_pending = false;
+static unsigned long long	 snapshot_gap_start_us;
+static pthread_mutex_t		 snapshot_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static CAMERA_SNAPSHOT_STATS snapshot_stats;
+
+static void			saveSnapshotRegisters(const struct sensor_reg * reglist);
+static unsigned int writeSensorDelta(const struct sensor_reg * reglist);
+
+// Zero shutter lag state, the latest pipeline frame is handed out to other threads
+static pthread_mutex_t	  zsl_lock	  = PTHREAD_MUTEX_INITIALIZER;
+static bool				  zsl_enabled = false;
+static bool				  zsl_running = false;
+static pthread_t		  zsl_thread;
+static CAMERA_FRAME *	  zsl_latest = NULL;
+static CAMERA_ZSL_STATS	  zsl_stats;
+static unsigned long long zsl_latency_total_us;
+
+static void	  keepLatestFrame(CAMERA_FRAME * frame);
+static void * zslThread(void * arg);
+
+// Sensor region of interest, in pixel array coordinates. The still tables window the array from
+// the origin below, and the scaler never enlarges the region past its native size.
+#define ROI_REG_COUNT 20
+static const unsigned int roi_array_width  = 2592;
+static const unsigned int roi_array_height = 1944;
+static const unsigned int roi_origin_x	   = 0x1b0;
+static const unsigned int roi_origin_y	   = 0x00a;
+static const unsigned int roi_min_width	   = 64;
+static const unsigned int roi_min_height   = 48;
+static const unsigned int roi_max_zoom	   = 8;
+static bool				  roi_enabled	   = false;
+static CAMERA_ROI		  roi;
+
+static void applyRoi();
+
+// JPEG rate control, the quantisation scale is steered so frames land near a byte budget
+static const unsigned int jpeg_qscale_reg		= 0x4407;
+static const unsigned int rate_qscale_min		= 2;
+static const unsigned int rate_qscale_max		= 63;
+static const unsigned int rate_deadband_percent = 10;
+static const unsigned int rate_average_shift	= 3;
+static unsigned int		  jpeg_qscale			= 0x04;
+static pthread_mutex_t	  rate_stats_lock		= PTHREAD_MUTEX_INITIALIZER;
+static CAMERA_RATE_STATS  rate_stats;
+
+static void rateControl(unsigned int size);
+
+// Automatic resolution, the still sizes are stepped up and down to hold a frame rate. A step down
+// right after a step up doubles the wait before the next step up so the sizes do not flap.
+static const unsigned int autores_window_frames	  = 15;
+static const unsigned int autores_down_percent	  = 90;
+static const unsigned int autores_up_percent	  = 115;
+static const unsigned int autores_up_hold_min	  = 2;
+static const unsigned int autores_up_hold_max	  = 32;
+static unsigned int		  autores_target_fps	  = 0;
+static RESOLUTION		  autores_min			  = RES_320x240;
+static RESOLUTION		  autores_max			  = RES_2592x1944;
+static unsigned int		  autores_window_count	  = 0;
+static unsigned long long autores_window_start_us = 0;
+static unsigned long long autores_readout_us	  = 0;
+static unsigned long long autores_bytes			  = 0;
+static unsigned int		  autores_hold			  = 0;
+static bool				  autores_last_up		  = false;
+static pthread_mutex_t	  autores_stats_lock	  = PTHREAD_MUTEX_INITIALIZER;
+static CAMERA_AUTORES_STATS autores_stats;
+
+static void autoResolution(unsigned int size, unsigned long long readout_us);
+
+// Sensor test pattern, -1 for the live image, and the timing of the last capture
+static int					 test_pattern = -1;
+static CAMERA_CAPTURE_TIMING capture_timing;
+
+static void writeTestPattern();
+
+// Cameras sharing the SPI bus, each ArduCHIP on its own chip select. The sensors share the I2C
+// bus and are programmed together, so only the FIFO side is per camera.
+struct CAMERA
+{
+	int				   spi_device;
+	unsigned int	   spi_cs;
+	bool			   triggered;
+	unsigned long long trigger_us;
+	unsigned long	   sequence;
+};
+
+static CAMERA *			  multi_cameras[CAMERA_MAX_INSTANCES];
+static unsigned int		  multi_count	= 0;
+static unsigned int		  multi_next	= 0;
+static bool				  multi_running = false;
+static CAMERA_MULTI_STATS multi_stats;
+
+static void			  triggerCamera(CAMERA * camera);
+static CAMERA_FRAME * drainCamera(unsigned int index);
+
+// Capture done wait, learned per resolution and exposure range
+#define WAIT_EXPOSURE_BUCKETS 13
+static const unsigned int wait_fine_poll_us		   = 50;
+static const unsigned int wait_legacy_poll_us	   = 5;
+static const unsigned int wait_wake_margin_us	   = 500;
+static const unsigned int wait_exposure_refresh_ms = 500;
+static bool				  wait_adaptive			   = true;
+static unsigned int		  wait_expected_us[RES_COUNT][WAIT_EXPOSURE_BUCKETS];
+static unsigned int		  wait_exposure_bucket	= 0;
+static unsigned long long wait_exposure_read_ms = 0;
+static unsigned long long capture_trigger_us	= 0;
+static RESOLUTION		  current_resolution	= RES_320x240;
+static pthread_mutex_t	  wait_stats_lock		= PTHREAD_MUTEX_INITIALIZER;
+static CAMERA_WAIT_STATS  wait_stats;
+
+static void				  waitForCapture();
+static unsigned long long threadCPUTimeUs();
+
+// Captures rejected as damaged JPEGs by any capture path
+static unsigned long frames_rejected = 0;
+
+static int			captureStreamBatch();
+static unsigned int drainFIFO(CAMERA_FRAME * frame);
+
+static pthread_mutex_t	  power_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool				  sensor_asleep	   = false;
+static unsigned long long sensor_state_change_ms;
+static CAMERA_POWER_STATS power_stats;
+
+static void updatePowerResidency();
+
+/**
+ * Initialize Camera variables and communication busses, then fully configure the sensor and let
+ * auto exposure settle
+ * @param i2c_bus The I2C bus number
+ * @param spi_bus The SPI bus number
+ * @return 0 on success or -1 if either bus did not come up, see Camera_get_init_status()
+ */
+int Camera_init(int i2c_bus, unsigned int spi_bus, unsigned int spi_cs)
+{
+	if(Camera_init_minimal(i2c_bus, spi_bus, spi_cs) < 0) { return -1; }
+
+	// A restored sensor kept streaming, so its exposure is already where it was
+	bool restored = sensor_restored;
+	Camera_init_complete(RES_320x240, EFFECT_NORMAL);
+
+	if(!restored) { Camera_wait_for_exposure_settle(settle_timeout_ms); }
+	return 0;
+}
 
 /**
- * Initialize Camera variables and communication busses
+ * First initialization stage, bring up the busses and program only the registers needed to
+ * capture a 320x240 JPEG. Frames captured before Camera_init_complete() may not be exposed well.
+ * The SPI link check and the I2C sensor programming run in parallel and retry with exponential
+ * backoff until the init deadline passes.
  * @param i2c_bus The I2C bus number
  * @param spi_bus The SPI bus number
+ * @return 0 on success or -1 if either bus did not come up, see Camera_get_init_status()
  */
-void Camera_init(int i2c_bus, unsigned int spi_bus, unsigned int spi_cs)
+int Camera_init_minimal(int i2c_bus, unsigned int spi_bus, unsigned int spi_cs)
 {
+	pthread_t spi_thread;
+	pthread_t i2c_thread;
+
 	format = IMG_JPEG;
 
+	memset(&init_status, 0, sizeof(init_status));
+	init_start_ms	   = Timer_now_ms();
+	init_reset_done = false;
+	sensor_restored = loadCheckpoint();
+
 	I2C_init(i2c_bus, camera_i2c_address);
 	SPI_init(spi_bus, spi_cs, 8000000);
 
-	Camera_reset_firmware();
+	bool spi_threaded = pthread_create(&spi_thread, NULL, spiBringUpThread, NULL) == 0;
+	bool i2c_threaded = pthread_create(&i2c_thread, NULL, i2cBringUpThread, NULL) == 0;
 
-	// Check for Camera until SPI exists
-	while(1)
+	// Fall back to bringing the busses up one after the other
+	if(!spi_threaded) { spiBringUpThread(NULL); }
+	if(!i2c_threaded) { i2cBringUpThread(NULL); }
+
+	if(spi_threaded) { pthread_join(spi_thread, NULL); }
+	if(i2c_threaded) { pthread_join(i2c_thread, NULL); }
+
+	init_status.total_ms = Timer_now_ms() - init_start_ms;
+
+	if(!init_status.spi_online || !init_status.i2c_online)
 	{
-		writeRegister(ARDUCHIP_TEST1, 0x55);
-		unsigned char temp = readRegister(ARDUCHIP_TEST1);
+		ERROR_PRINTLN("Camera bring-up failed after %llu ms: SPI %s, I2C %s",
+					  init_status.total_ms,
+					  init_status.spi_online ? "online" : "offline",
+					  init_status.i2c_online ? "online" : "offline");
+		return -1;
+	}
+
+	setBit(ARDUCHIP_TIM, VSYNC_LEVEL_MASK);
+
+	clearFIFOFlag();
+	writeRegister(ARDUCHIP_FRAMES, 0x00);
+
+	pthread_mutex_lock(&power_stats_lock);
+	memset(&power_stats, 0, sizeof(power_stats));
+	sensor_asleep		   = false;
+	sensor_state_change_ms = Timer_now_ms();
+	pthread_mutex_unlock(&power_stats_lock);
+
+	DEBUG_PRINTLN("Camera online in %llu ms: SPI after %u tries, I2C after %u tries",
+				  init_status.total_ms,
+				  init_status.spi_attempts,
+				  init_status.i2c_attempts);
+	return 0;
+}
+
+/**
+ * Remember the value written to a sensor register
+ * @param regID the register ID
+ * @param regDat the value written
+ */
+static void shadowRecord(unsigned int regID, unsigned char regDat)
+{
+	regID &= SENSOR_REG_COUNT - 1;
+
+	// A software reset returns every register to its default
+	if(regID == sensor_system_control_reg && (regDat & 0x80)) { shadowClear(); }
+
+	sensor_shadow[regID] = regDat;
+	sensor_shadow_valid[regID / 8] |= 1 << (regID % 8);
+}
+
+/**
+ * Check if the shadow shows a register already holding a value
+ * @param regID the register ID
+ * @param regDat the value
+ * @return true if the register is known to hold the value
+ */
+static bool shadowMatches(unsigned int regID, unsigned char regDat)
+{
+	regID &= SENSOR_REG_COUNT - 1;
+
+	return (sensor_shadow_valid[regID / 8] & (1 << (regID % 8))) && sensor_shadow[regID] == regDat;
+}
+
+/**
+ * Check if writing a register performs an action, such as a reset or an exposure mode change,
+ * so a write of the same value still matters
+ * @param regID the register ID
+ * @return true if every write to the register has to reach the sensor
+ */
+static bool shadowIsCommand(unsigned int regID)
+{
+	return (regID >= 0x3000 && regID <= 0x3003) || regID == sensor_system_control_reg ||
+		   regID == 0x3503;
+}
+
+/**
+ * Forget all recorded sensor register values
+ */
+static void shadowClear() { memset(sensor_shadow_valid, 0, sizeof(sensor_shadow_valid)); }
+
+/**
+ * Check if a register changes on its own or is only a command, so it cannot be verified
+ * @param regID the register ID
+ * @return true if the register value is not stable
+ */
+static bool shadowIsVolatile(unsigned int regID)
+{
+	return regID == sensor_system_control_reg || (regID >= 0x3500 && regID <= 0x350d) ||
+		   (regID >= 0x5680 && regID <= 0x56ff);
+}
+
+/**
+ * Read the checkpoint file into memory if it matches the current image format
+ * @return true if a usable checkpoint was loaded
+ */
+static bool loadCheckpoint()
+{
+	free(checkpoint_regs);
+	checkpoint_regs		 = NULL;
+	checkpoint_reg_count = 0;
+
+	if(checkpoint_filename == NULL) { return false; }
+
+	FILE * checkpoint_file = fopen(checkpoint_filename, "rb");
+	if(checkpoint_file == NULL) { return false; }
+
+	char		 magic[sizeof(checkpoint_magic)];
+	unsigned int header[5];
+	bool		 valid = fread(magic, sizeof(magic), 1, checkpoint_file) == 1 &&
+				 fread(header, sizeof(header), 1, checkpoint_file) == 1 &&
+				 memcmp(magic, checkpoint_magic, sizeof(magic)) == 0 &&
+				 header[0] == checkpoint_version && header[1] == (unsigned int) format &&
+				 header[4] > 0 && header[4] <= SENSOR_REG_COUNT;
+
+	if(valid)
+	{
+		checkpoint_regs = malloc((header[4] + 1) * sizeof(struct sensor_reg));
+		valid			= checkpoint_regs != NULL;
+	}
+
+	for(unsigned int i = 0; valid && i < header[4]; i++)
+	{
+		unsigned char entry[3];
+		valid = fread(entry, sizeof(entry), 1, checkpoint_file) == 1;
 
-		if(temp != 0x55)
+		checkpoint_regs[i].reg = (entry[0] << 8) | entry[1];
+		checkpoint_regs[i].val = entry[2];
+	}
+
+	fclose(checkpoint_file);
+
+	if(!valid)
+	{
+		ERROR_PRINTLN("Ignoring invalid sensor checkpoint %s", checkpoint_filename);
+		free(checkpoint_regs);
+		checkpoint_regs = NULL;
+		return false;
+	}
+
+	checkpoint_reg_count  = header[4];
+	checkpoint_resolution = header[2];
+	current_resolution	  = checkpoint_resolution;
+	checkpoint_effect	  = header[3];
+
+	checkpoint_regs[checkpoint_reg_count].reg = 0xffff;
+	checkpoint_regs[checkpoint_reg_count].val = 0xff;
+
+	return true;
+}
+
+/**
+ * Read back an evenly spread sample of checkpointed registers from the sensor
+ * @return true if every sampled register still holds its checkpointed value
+ */
+static bool verifyCheckpoint()
+{
+	struct sensor_reg sample[checkpoint_sample_count + 1];
+	unsigned char	  expected[checkpoint_sample_count];
+	unsigned int	  count = 0;
+	unsigned int	  step	= checkpoint_reg_count / checkpoint_sample_count + 1;
+
+	for(unsigned int i = 0; i < checkpoint_reg_count && count < checkpoint_sample_count; i += step)
+	{
+		// Step forward to the next register that holds its value
+		while(i < checkpoint_reg_count && shadowIsVolatile(checkpoint_regs[i].reg)) { i++; }
+		if(i >= checkpoint_reg_count) { break; }
+
+		sample[count].reg = checkpoint_regs[i].reg;
+		sample[count].val = checkpoint_regs[i].val;
+		expected[count]	  = checkpoint_regs[i].val;
+		count++;
+	}
+
+	sample[count].reg = 0xffff;
+	sample[count].val = 0xff;
+
+	rdSensorRegs16_8(sample);
+
+	for(unsigned int i = 0; i < count; i++)
+	{
+		if(sample[i].val != expected[i])
 		{
-			ERROR_PRINTLN("Camera SPI unavailable.");
-			Timer_delay_ms(1000);
+			DEBUG_PRINTLN("Sensor register 0x%04x is 0x%02x, checkpoint has 0x%02x, reprogramming",
+						  sample[i].reg,
+						  sample[i].val,
+						  expected[i]);
+			return false;
 		}
-		else
+	}
+
+	DEBUG_PRINTLN("Sensor matches checkpoint on %u sampled registers", count);
+	return count > 0;
+}
+
+/**
+ * Adopt the checkpoint as the sensor state and make sure the sensor is streaming
+ */
+static void restoreCheckpoint()
+{
+	shadowClear();
+
+	for(unsigned int i = 0; i < checkpoint_reg_count; i++)
+	{
+		shadowRecord(checkpoint_regs[i].reg, checkpoint_regs[i].val);
+	}
+
+	// The previous process may have left the sensor in software power down
+	wrSensorReg16_8(sensor_system_control_reg, sensor_system_streaming);
+
+	DEBUG_PRINTLN("Restored sensor state from checkpoint, skipping reprogramming");
+}
+
+/**
+ * Get the outcome of the most recent bus bring-up
+ * @param[out] status the per bus results and timings
+ */
+void Camera_get_init_status(CAMERA_INIT_STATUS * status) { *status = init_status; }
+
+/**
+ * Set how long the bus bring-up keeps retrying before Camera_init() gives up
+ * @param deadline_ms The overall deadline in milliseconds
+ */
+void Camera_set_init_deadline_ms(unsigned int deadline_ms) { init_deadline_ms = deadline_ms; }
+
+/**
+ * Sleep before the next bring-up attempt without passing the init deadline
+ * @param[in,out] backoff_ms the current backoff, doubled for the next attempt
+ * @return false if the deadline has passed and no further attempt should be made
+ */
+static bool initBackoff(unsigned int * backoff_ms)
+{
+	unsigned long long elapsed_ms = Timer_now_ms() - init_start_ms;
+
+	if(elapsed_ms >= init_deadline_ms) { return false; }
+
+	unsigned int delay_ms = *backoff_ms;
+	if(delay_ms > init_deadline_ms - elapsed_ms) { delay_ms = init_deadline_ms - elapsed_ms; }
+
+	Timer_delay_ms(delay_ms);
+
+	*backoff_ms *= 2;
+	if(*backoff_ms > init_backoff_max_ms) { *backoff_ms = init_backoff_max_ms; }
+
+	return true;
+}
+
+/**
+ * Reset the ArduCHIP and check the SPI link by writing and reading its test register
+ * @param arg Unused
+ * @return Unused
+ */
+static void * spiBringUpThread(void * arg)
+{
+	unsigned int backoff_ms = init_backoff_start_ms;
+
+	writeRegister(0x07, 0x80);
+	Timer_delay_ms(100);
+	writeRegister(0x07, 0x00);
+
+	// The sensor is not programmed until the ArduCHIP reset has been released
+	pthread_mutex_lock(&init_lock);
+	init_reset_done = true;
+	pthread_cond_broadcast(&init_cond);
+	pthread_mutex_unlock(&init_lock);
+
+	Timer_delay_ms(100);
+
+	do {
+		init_status.spi_attempts++;
+		writeRegister(ARDUCHIP_TEST1, 0x55);
+
+		if(readRegister(ARDUCHIP_TEST1) == 0x55)
 		{
+			init_status.spi_online	 = true;
+			init_status.spi_ready_ms = Timer_now_ms() - init_start_ms;
 			DEBUG_PRINTLN("Camera SPI online.");
-			break;
+			return 0;
 		}
-	}
 
+		ERROR_PRINTLN("Camera SPI unavailable.");
+	} while(initBackoff(&backoff_ms));
+
+	return 0;
+}
+
+/**
+ * Check the sensor chip ID over I2C, then program the minimal register set
+ * @param arg Unused
+ * @return Unused
+ */
+static void * i2cBringUpThread(void * arg)
+{
+	unsigned int  backoff_ms = init_backoff_start_ms;
 	unsigned char pid = 0, vid = 0;
 
-	// Check for camera I2C until it exists
-	while(1)
-	{
+	do {
+		init_status.i2c_attempts++;
 		rdSensorReg16_8(OV5642_CHIPID_HIGH, &vid);
 		rdSensorReg16_8(OV5642_CHIPID_LOW, &pid);
 
-		if(vid != 0x56 || pid != 0x42)
-		{
-			ERROR_PRINTLN("Camera I2C unavailable: vid = 0x%x, pid = 0x%x", vid, pid);
-			Timer_delay_ms(1000);
-		}
-		else
+		if(vid == 0x56 && pid == 0x42)
 		{
+			init_status.i2c_online = true;
 			DEBUG_PRINTLN("Camera I2C online.");
 			break;
 		}
+
+		ERROR_PRINTLN("Camera I2C unavailable: vid = 0x%x, pid = 0x%x", vid, pid);
+	} while(initBackoff(&backoff_ms));
+
+	init_status.sensor_vid = vid;
+	init_status.sensor_pid = pid;
+
+	if(!init_status.i2c_online) { return 0; }
+
+	// A sensor still holding the checkpointed configuration only needs to resume streaming
+	if(sensor_restored && verifyCheckpoint())
+	{
+		restoreCheckpoint();
+		init_status.restored	 = true;
+		init_status.i2c_ready_ms = Timer_now_ms() - init_start_ms;
+		return 0;
 	}
 
+	sensor_restored = false;
+
+	pthread_mutex_lock(&init_lock);
+	while(!init_reset_done) { pthread_cond_wait(&init_cond, &init_lock); }
+	pthread_mutex_unlock(&init_lock);
+
+	programSensorMinimal();
+	init_status.i2c_ready_ms = Timer_now_ms() - init_start_ms;
+
+	return 0;
+}
+
+/**
+ * Program the sensor tables needed for a 320x240 capture in the current image format
+ */
+static void programSensorMinimal()
+{
+	// No settle delay here, the first capture already waits for a complete frame
+	current_resolution = RES_320x240;
 	wrSensorReg16_8(0x3008, 0x80);
 	wrSensorRegs16_8(OV5642_QVGA_Preview);
-	Timer_delay_ms(100);
 
 	if(format == IMG_JPEG)
 	{
@@ -136,7 +709,6 @@ void Camera_init(int i2c_bus, unsigned int spi_bus, unsigned int spi_cs)
 		wrSensorReg16_8(0x3818, 0xa8);
 		wrSensorReg16_8(0x3621, 0x10);
 		wrSensorReg16_8(0x3801, 0xb0);
-		wrSensorReg16_8(0x4407, 0x04);
 		wrSensorReg16_8(0x5888, 0x00);
 	}
 	else
@@ -153,14 +725,173 @@ void Camera_init(int i2c_bus, unsigned int spi_bus, unsigned int spi_cs)
 		rdSensorReg16_8(0x3621, &reg_val);
 		wrSensorReg16_8(0x3621, reg_val & 0xdf);
 	}
+}
 
-	setBit(ARDUCHIP_TIM, VSYNC_LEVEL_MASK);
-	Camera_set_resolution(RES_320x240);
+/**
+ * Second initialization stage, program image quality, effect and the final resolution. This only
+ * writes registers, so it may run between two captures on the capturing thread. Auto exposure
+ * keeps converging over the frames that follow; Camera_wait_for_exposure_settle() waits for it.
+ * @param res The resolution to stream at once initialization is complete
+ * @param effect The special effect to apply
+ */
+void Camera_init_complete(RESOLUTION res, SPECIAL_EFFECTS effect)
+{
+	// A restored sensor has been streaming all along, so only changed settings are applied
+	if(sensor_restored)
+	{
+		if(effect != checkpoint_effect) { Camera_set_special_effect(effect); }
+		if(res != checkpoint_resolution) { Camera_set_resolution(res); }
+	}
+	else
+	{
+		if(format == IMG_JPEG) { wrSensorReg16_8(jpeg_qscale_reg, jpeg_qscale); }
 
-	Timer_delay_ms(1000);
+		Camera_set_special_effect(effect);
 
-	clearFIFOFlag();
-	writeRegister(ARDUCHIP_FRAMES, 0x00);
+		// The minimal stage already left the sensor at 320x240
+		if(res != RES_320x240) { Camera_set_resolution(res); }
+	}
+
+	checkpoint_resolution = res;
+	checkpoint_effect	  = effect;
+	sensor_restored		  = false;
+
+	if(roi_enabled) { applyRoi(); }
+
+	if(checkpoint_filename != NULL) { Camera_save_checkpoint(); }
+
+	DEBUG_PRINTLN("Camera initialization complete");
+}
+
+/**
+ * Set the file used to persist the sensor configuration across process restarts
+ * @param filename the checkpoint path, or NULL to always reprogram the sensor
+ */
+void Camera_set_checkpoint_file(const char * filename) { checkpoint_filename = filename; }
+
+/**
+ * Write the intended sensor register state to the checkpoint file. The file is replaced
+ * atomically so a crash mid-write leaves the previous checkpoint intact.
+ * @return 0 on success or -1 on failure
+ */
+int Camera_save_checkpoint()
+{
+	if(checkpoint_filename == NULL) { return -1; }
+
+	char temp_filename[256];
+	snprintf(temp_filename, sizeof(temp_filename), "%s.tmp", checkpoint_filename);
+
+	FILE * checkpoint_file = fopen(temp_filename, "wb");
+
+	if(checkpoint_file == NULL)
+	{
+		ERROR_PRINTLN("Failed to open %s", temp_filename);
+		return -1;
+	}
+
+	unsigned int header[5] = {
+		checkpoint_version, format, checkpoint_resolution, checkpoint_effect, 0};
+
+	// The system control register only holds reset and power down commands, and 0xffff would read
+	// back as the end of the table
+	for(unsigned int reg = 0; reg < SENSOR_REG_COUNT - 1; reg++)
+	{
+		if(reg != sensor_system_control_reg && (sensor_shadow_valid[reg / 8] & (1 << (reg % 8))))
+		{
+			header[4]++;
+		}
+	}
+
+	fwrite(checkpoint_magic, sizeof(checkpoint_magic), 1, checkpoint_file);
+	fwrite(header, sizeof(header), 1, checkpoint_file);
+
+	for(unsigned int reg = 0; reg < SENSOR_REG_COUNT - 1; reg++)
+	{
+		if(reg != sensor_system_control_reg && (sensor_shadow_valid[reg / 8] & (1 << (reg % 8))))
+		{
+			unsigned char entry[3] = {(reg >> 8) & 0xFF, reg & 0xFF, sensor_shadow[reg]};
+			fwrite(entry, sizeof(entry), 1, checkpoint_file);
+		}
+	}
+
+	int err = ferror(checkpoint_file);
+
+	if(fclose(checkpoint_file) < 0 || err != 0 || rename(temp_filename, checkpoint_filename) < 0)
+	{
+		ERROR_PRINTLN("Failed to write sensor checkpoint %s", checkpoint_filename);
+		unlink(temp_filename);
+		return -1;
+	}
+
+	DEBUG_PRINTLN("Saved %u sensor registers to %s", header[4], checkpoint_filename);
+	return 0;
+}
+
+/**
+ * Set the longest time Camera_init() waits for auto exposure to settle
+ * @param timeout_ms The upper bound in milliseconds
+ */
+void Camera_set_settle_timeout_ms(unsigned int timeout_ms) { settle_timeout_ms = timeout_ms; }
+
+/**
+ * Wait until the sensor's exposure, gain and average luminance stop changing
+ * @param timeout_ms The longest time to wait before giving up
+ * @return The time spent waiting in milliseconds
+ */
+unsigned int Camera_wait_for_exposure_settle(unsigned int timeout_ms)
+{
+	unsigned long long start_ms		 = Timer_now_ms();
+	unsigned int	   stable_count	 = 0;
+	unsigned int	   last_exposure = 0, last_gain = 0, last_luma = 0;
+	bool			   have_sample	 = false;
+
+	while(Timer_now_ms() - start_ms < timeout_ms)
+	{
+		unsigned char exp_high, exp_mid, exp_low, gain_high, gain_low, luma;
+
+		rdSensorReg16_8(sensor_aec_exposure_reg, &exp_high);
+		rdSensorReg16_8(sensor_aec_exposure_reg + 1, &exp_mid);
+		rdSensorReg16_8(sensor_aec_exposure_reg + 2, &exp_low);
+		rdSensorReg16_8(sensor_agc_gain_reg, &gain_high);
+		rdSensorReg16_8(sensor_agc_gain_reg + 1, &gain_low);
+		rdSensorReg16_8(sensor_average_luma_reg, &luma);
+
+		unsigned int exposure = ((exp_high & 0x0f) << 16) | (exp_mid << 8) | exp_low;
+		unsigned int gain	  = ((gain_high & 0x03) << 8) | gain_low;
+
+		// Exposure steps are compared in whole lines, the low nibble is a fraction of a line
+		if(have_sample && (exposure >> 4) == (last_exposure >> 4) &&
+		   abs((int) gain - (int) last_gain) <= settle_gain_tolerance &&
+		   abs((int) luma - (int) last_luma) <= settle_luma_tolerance)
+		{
+			stable_count++;
+		}
+		else
+		{
+			stable_count = 0;
+		}
+
+		last_exposure = exposure;
+		last_gain	  = gain;
+		last_luma	  = luma;
+		have_sample	  = true;
+
+		if(stable_count >= settle_stable_samples)
+		{
+			unsigned int settle_ms = Timer_now_ms() - start_ms;
+			DEBUG_PRINTLN("Exposure settled in %u ms: exposure = 0x%x, gain = 0x%x, luma = %u",
+						  settle_ms,
+						  exposure,
+						  gain,
+						  luma);
+			return settle_ms;
+		}
+
+		Timer_delay_ms(settle_poll_interval_ms);
+	}
+
+	ERROR_PRINTLN("Exposure did not settle within %u ms", timeout_ms);
+	return Timer_now_ms() - start_ms;
 }
 
 /**
@@ -169,6 +900,18 @@ void Camera_init(int i2c_bus, unsigned int spi_bus, unsigned int spi_cs)
 void Camera_shutdown()
 {
 	DEBUG_PRINTLN("Shutting down camera");
+	Camera_stop_zsl();
+	Camera_set_zsl(false);
+	Camera_stop_stream();
+	Camera_stop_multi();
+
+	FramePool_release(capture_frame);
+	FramePool_destroy(frame_pool);
+	FramePool_destroy(snapshot_pool);
+	capture_frame = NULL;
+	frame_pool	  = NULL;
+	snapshot_pool = NULL;
+
 	I2C_shutdown();
 	SPI_shutdown();
 }
@@ -185,39 +928,78 @@ void Camera_set_image_format(IMAGE_TYPE img_format) { format = img_format; }
  */
 void Camera_set_resolution(RESOLUTION res)
 {
+	if(res >= RES_COUNT) { return; }
+
+	// The video presets start with a software reset, so a still size needs the JPEG setup again
+	bool leaving_video = current_resolution >= RES_1280x720 && res < RES_1280x720;
+
+	if(leaving_video)
+	{
+		programSensorMinimal();
+		if(format == IMG_JPEG) { wrSensorReg16_8(jpeg_qscale_reg, jpeg_qscale); }
+	}
+
+	current_resolution	 = res;
+	pipeline_interval_us = 0;
+
+	if(resolution_target_fps[res] > 0)
+	{
+		pipeline_interval_us = 1000000 / resolution_target_fps[res];
+	}
+
 	switch(res)
 	{
 		case RES_320x240:
 			DEBUG_PRINTLN("Setting resolution to 320x240");
-			wrSensorRegs16_8(ov5642_320x240);
+			writeSensorDelta(ov5642_320x240);
 			break;
 		case RES_640x480:
 			DEBUG_PRINTLN("Setting resolution to 640x480");
-			wrSensorRegs16_8(ov5642_640x480);
+			writeSensorDelta(ov5642_640x480);
 			break;
 		case RES_1024x768:
 			DEBUG_PRINTLN("Setting resolution to 1024x768");
-			wrSensorRegs16_8(ov5642_1024x768);
+			writeSensorDelta(ov5642_1024x768);
 			break;
 		case RES_1280x960:
 			DEBUG_PRINTLN("Setting resolution to 1280x960");
-			wrSensorRegs16_8(ov5642_1280x960);
+			writeSensorDelta(ov5642_1280x960);
 			break;
 		case RES_1600x1200:
 			DEBUG_PRINTLN("Setting resolution to 1600x1200");
-			wrSensorRegs16_8(ov5642_1600x1200);
+			writeSensorDelta(ov5642_1600x1200);
 			break;
 		case RES_2048x1536:
 			DEBUG_PRINTLN("Setting resolution to 2048x1536");
-			wrSensorRegs16_8(ov5642_2048x1536);
+			writeSensorDelta(ov5642_2048x1536);
 			break;
 		case RES_2592x1944:
 			DEBUG_PRINTLN("Setting resolution to 2592x1944");
-			wrSensorRegs16_8(ov5642_2592x1944);
+			writeSensorDelta(ov5642_2592x1944);
+			break;
+		case RES_1280x720:
+			DEBUG_PRINTLN("Setting video mode to 720p");
+			writeSensorDelta(OV5642_720P_Video_setting);
+			break;
+		case RES_1920x1080:
+			DEBUG_PRINTLN("Setting video mode to 1080p");
+			writeSensorDelta(OV5642_1080P_Video_setting);
 			break;
 		default:
 			break;
 	}
+
+	// Switching to or from a video preset reset the sensor, so the effect is put back
+	if(leaving_video || res >= RES_1280x720)
+	{
+		Camera_set_special_effect(checkpoint_effect);
+		if(test_pattern >= 0) { writeTestPattern(); }
+	}
+
+	// Every video preset table writes its own 0x4407, so put the rate controller's scale back
+	if(res >= RES_1280x720 && format == IMG_JPEG) { wrSensorReg16_8(jpeg_qscale_reg, jpeg_qscale); }
+
+	if(roi_enabled) { applyRoi(); }
 }
 
 /**
@@ -438,40 +1220,1699 @@ void Camera_set_sharpness_type(SHARPNESS_TYPE sharpness)
 }
 
 /**
- * Reset camera settings to default
+ * Replace the image with a fixed test pattern so benchmark runs compress the same content every
+ * time. The pattern is kept across resolution changes.
+ * @param pattern the pattern to show
  */
-void Camera_reset_firmware()
+void Camera_set_test_pattern(enum COLOR_TYPE pattern)
 {
-	writeRegister(0x07, 0x80);
-	Timer_delay_ms(100);
-	writeRegister(0x07, 0x00);
-	Timer_delay_ms(100);
+	test_pattern = pattern;
+	writeTestPattern();
 }
 
 /**
- * Capture a single image into the read buffer
+ * Return to the live image after Camera_set_test_pattern()
  */
-void Camera_single_capture()
+void Camera_clear_test_pattern()
 {
-	flushFIFO();
-	clearFIFOFlag();
-	Camera_start_capture();
-
-	while(!getBit(ARDUCHIP_TRIG, CAP_DONE_MASK)) { Timer_delay_us(5); }
-
-	int count				 = readFIFOLength();
-	current_jpeg_buffer_size = count;
-	int i					 = 0;
-
-	while((count--) > 0) { read_buffer[i++] = readFIFO(); }
-	DEBUG_PRINTLN("Single image captured, size: %d bytes", current_jpeg_buffer_size);
+	test_pattern = -1;
+	writeTestPattern();
 }
 
 /**
- * Save the most recent camera capture to a given file
- * @param filename the name of the file to save to
+ * Program the selected test pattern, or turn both pattern generators off
  */
-void Camera_save_capture_to_file(const char * filename)
+static void writeTestPattern()
+{
+	switch(test_pattern)
+	{
+		case COLOR_BAR:
+			wrSensorReg16_8(0x503d, 0x80);
+			wrSensorReg16_8(0x503e, 0x00);
+			break;
+		case COLOR_SQUARE:
+			wrSensorReg16_8(0x503d, 0x85);
+			wrSensorReg16_8(0x503e, 0x12);
+			break;
+		case COLOR_BW_SQUARE:
+			wrSensorReg16_8(0x503d, 0x85);
+			wrSensorReg16_8(0x503e, 0x1a);
+			break;
+		case COLOR_DLI:
+			wrSensorReg16_8(0x503d, 0x00);
+			wrSensorReg16_8(0x4741, 0x04);
+			break;
+		default:
+			wrSensorReg16_8(0x503d, 0x00);
+			break;
+	}
+
+	// The DLI pattern comes from the DVP output rather than the ISP
+	if(test_pattern != COLOR_DLI) { wrSensorReg16_8(0x4741, 0x00); }
+}
+
+/**
+ * Reset camera settings to default
+ */
+void Camera_reset_firmware()
+{
+	writeRegister(0x07, 0x80);
+	Timer_delay_ms(100);
+	writeRegister(0x07, 0x00);
+	Timer_delay_ms(100);
+}
+
+/**
+ * Put the sensor into software power down, which keeps every register value
+ */
+void Camera_sleep()
+{
+	if(sensor_asleep) { return; }
+
+	wrSensorReg16_8(sensor_system_control_reg, sensor_system_power_down);
+
+	pthread_mutex_lock(&power_stats_lock);
+	updatePowerResidency();
+	sensor_asleep = true;
+	pthread_mutex_unlock(&power_stats_lock);
+
+	DEBUG_PRINTLN("Camera sensor in standby");
+}
+
+/**
+ * Bring the sensor out of software power down and wait for it to stream frames again
+ */
+void Camera_wake()
+{
+	if(!sensor_asleep) { return; }
+
+	unsigned long long wake_start_us = Timer_now_us();
+	wrSensorReg16_8(sensor_system_control_reg, sensor_system_streaming);
+
+	pthread_mutex_lock(&power_stats_lock);
+	updatePowerResidency();
+	sensor_asleep = false;
+	pthread_mutex_unlock(&power_stats_lock);
+
+	// The sensor is streaming again once the next VSYNC pulse starts
+	unsigned char vsync = getBit(ARDUCHIP_TRIG, VSYNC_MASK);
+	while(getBit(ARDUCHIP_TRIG, VSYNC_MASK) == vsync)
+	{
+		if(Timer_now_us() - wake_start_us > sensor_wake_timeout_us)
+		{
+			ERROR_PRINTLN("Camera sensor did not resume streaming after wake");
+			break;
+		}
+
+		Timer_delay_us(50);
+	}
+
+	unsigned long long wake_time_us = Timer_now_us() - wake_start_us;
+
+	pthread_mutex_lock(&power_stats_lock);
+	power_stats.last_wake_us = wake_time_us;
+	power_stats.wake_count++;
+
+	if(wake_time_us > power_stats.max_wake_us) { power_stats.max_wake_us = wake_time_us; }
+	pthread_mutex_unlock(&power_stats_lock);
+
+	DEBUG_PRINTLN("Camera sensor awake after %llu us", wake_time_us);
+}
+
+/**
+ * Get the sensor standby residency, wake latency and estimated average power
+ * @param[out] stats the power statistics since the camera was initialized
+ */
+void Camera_get_power_stats(CAMERA_POWER_STATS * stats)
+{
+	pthread_mutex_lock(&power_stats_lock);
+	updatePowerResidency();
+
+	unsigned long long total_ms = power_stats.awake_ms + power_stats.standby_ms;
+
+	power_stats.est_average_power_mw =
+		total_ms > 0 ? (power_stats.awake_ms * sensor_active_power_mw +
+						power_stats.standby_ms * sensor_standby_power_mw) /
+						   total_ms :
+					   0;
+
+	*stats = power_stats;
+	pthread_mutex_unlock(&power_stats_lock);
+}
+
+/**
+ * Add the time since the last sleep or wake to the matching residency counter, called with
+ * power_stats_lock held
+ */
+static void updatePowerResidency()
+{
+	unsigned long long now_ms = Timer_now_ms();
+
+	if(sensor_asleep) { power_stats.standby_ms += now_ms - sensor_state_change_ms; }
+	else
+	{
+		power_stats.awake_ms += now_ms - sensor_state_change_ms;
+	}
+
+	sensor_state_change_ms = now_ms;
+}
+
+/**
+ * Get the frame rate a resolution is streamed at by the capture engine
+ * @param res the capture resolution
+ * @return the target frames per second, or 0 for still sizes which are not paced
+ */
+unsigned int Camera_target_fps(RESOLUTION res)
+{
+	return res < RES_COUNT ? resolution_target_fps[res] : 0;
+}
+
+/**
+ * Capture only a region of the pixel array. The region is scaled down to fit the current
+ * resolution but never enlarged, so a small region sends fewer bytes over SPI per frame. Video
+ * presets bin the array and keep their full field of view until a still size is selected.
+ * @param region the region in 2592x1944 pixel array coordinates, or NULL for the full array
+ * @return 0 on success or -1 if the region is outside the array or too small
+ */
+int Camera_set_roi(const CAMERA_ROI * region)
+{
+	if(region == NULL)
+	{
+		roi_enabled = false;
+		roi			= (CAMERA_ROI){0, 0, roi_array_width, roi_array_height};
+	}
+	else
+	{
+		if(region->width < roi_min_width || region->height < roi_min_height ||
+		   region->x + region->width > roi_array_width ||
+		   region->y + region->height > roi_array_height)
+		{
+			ERROR_PRINTLN("Region %ux%u at %u,%u does not fit the pixel array",
+						  region->width,
+						  region->height,
+						  region->x,
+						  region->y);
+			return -1;
+		}
+
+		// The Bayer pattern repeats every two pixels, so the window keeps to even coordinates
+		roi_enabled = true;
+		roi.x		= region->x & ~1u;
+		roi.y		= region->y & ~1u;
+		roi.width	= region->width & ~1u;
+		roi.height	= region->height & ~1u;
+	}
+
+	if(init_status.i2c_online) { applyRoi(); }
+
+	return 0;
+}
+
+/**
+ * Zoom into the centre of the pixel array
+ * @param zoom the magnification from 1, the full array, to 8
+ * @return 0 on success or -1 if the zoom is out of range
+ */
+int Camera_set_zoom(unsigned int zoom)
+{
+	if(zoom < 1 || zoom > roi_max_zoom)
+	{
+		ERROR_PRINTLN("Zoom %u is outside 1 to %u", zoom, roi_max_zoom);
+		return -1;
+	}
+
+	if(zoom == 1) { return Camera_set_roi(NULL); }
+
+	CAMERA_ROI region;
+	region.width  = roi_array_width / zoom;
+	region.height = roi_array_height / zoom;
+	region.x	  = (roi_array_width - region.width) / 2;
+	region.y	  = (roi_array_height - region.height) / 2;
+
+	return Camera_set_roi(&region);
+}
+
+/**
+ * Get the region of interest and the frame size it is captured at
+ * @param region filled with the region in pixel array coordinates
+ * @param width filled with the output frame width, may be NULL
+ * @param height filled with the output frame height, may be NULL
+ * @return true if a region is set, false if the full array is captured
+ */
+bool Camera_get_roi(CAMERA_ROI * region, unsigned int * width, unsigned int * height)
+{
+	unsigned int output_width  = resolution_width[current_resolution];
+	unsigned int output_height = resolution_height[current_resolution];
+
+	if(!roi_enabled)
+	{
+		*region = (CAMERA_ROI){0, 0, roi_array_width, roi_array_height};
+	}
+	else
+	{
+		*region = roi;
+
+		// Fit the region inside the resolution keeping its aspect, without enlarging it
+		if(current_resolution < RES_1280x720 &&
+		   (roi.width < output_width || roi.height < output_height ||
+			roi.width * output_height != roi.height * output_width))
+		{
+			if(roi.width * output_height > roi.height * output_width)
+			{
+				output_height = roi.height * output_width / roi.width;
+			}
+			else
+			{
+				output_width = roi.width * output_height / roi.height;
+			}
+
+			if(output_width > roi.width) { output_width = roi.width; }
+			if(output_height > roi.height) { output_height = roi.height; }
+
+			// Whole JPEG blocks only
+			output_width &= ~15u;
+			output_height &= ~7u;
+		}
+	}
+
+	if(width != NULL) { *width = output_width; }
+	if(height != NULL) { *height = output_height; }
+
+	return roi_enabled;
+}
+
+/**
+ * Program the sensor window, output size and scaler for the region of interest. Registers that
+ * already hold the right value are skipped, so a resolution change only rewrites what moved.
+ */
+static void applyRoi()
+{
+	if(current_resolution >= RES_1280x720) { return; }
+
+	CAMERA_ROI	 region;
+	unsigned int width, height;
+	Camera_get_roi(&region, &width, &height);
+
+	// Window start and size, output size, then the scaler input window within the output window
+	unsigned int values[] = {roi_origin_x + region.x,
+							 roi_origin_y + region.y,
+							 region.width,
+							 region.height,
+							 width,
+							 height,
+							 0,
+							 region.width,
+							 0,
+							 region.height};
+	unsigned int first[]  = {0x3800, 0x3802, 0x3804, 0x3806, 0x3808, 0x380a, 0x5680, 0x5682,
+							 0x5684, 0x5686};
+
+	struct sensor_reg regs[ROI_REG_COUNT + 1];
+
+	for(unsigned int i = 0; i < ROI_REG_COUNT / 2; i++)
+	{
+		regs[i * 2]		= (struct sensor_reg){first[i], (values[i] >> 8) & 0xff};
+		regs[i * 2 + 1] = (struct sensor_reg){first[i] + 1, values[i] & 0xff};
+	}
+
+	regs[ROI_REG_COUNT] = (struct sensor_reg){0xffff, 0xff};
+
+	unsigned int written = writeSensorDelta(regs);
+
+	DEBUG_PRINTLN("Capturing %ux%u at %u,%u as %ux%u, %u registers written",
+				  region.width,
+				  region.height,
+				  region.x,
+				  region.y,
+				  width,
+				  height,
+				  written);
+}
+
+/**
+ * Set a fixed JPEG compression level, turning off the frame size budget
+ * @param quality the compression level
+ */
+void Camera_set_quality(enum QUALITY quality)
+{
+	switch(quality)
+	{
+		case QUALITY_HIGH:
+			jpeg_qscale = 0x04;
+			break;
+		case QUALITY_DEFAULT:
+			jpeg_qscale = 0x08;
+			break;
+		case QUALITY_LOW:
+			jpeg_qscale = 0x0c;
+			break;
+		default:
+			return;
+	}
+
+	pthread_mutex_lock(&rate_stats_lock);
+	rate_stats.target_bytes = 0;
+	rate_stats.qscale		= jpeg_qscale;
+	pthread_mutex_unlock(&rate_stats_lock);
+
+	wrSensorReg16_8(jpeg_qscale_reg, jpeg_qscale);
+}
+
+/**
+ * Steer the JPEG quantisation scale after every frame so frames stay near a byte budget, keeping
+ * the SPI readout time and storage bandwidth steady as the scene changes
+ * @param target_bytes the frame size to aim for, or 0 to keep the current quality
+ */
+void Camera_set_frame_budget(unsigned int target_bytes)
+{
+	pthread_mutex_lock(&rate_stats_lock);
+	memset(&rate_stats, 0, sizeof(rate_stats));
+	rate_stats.target_bytes = target_bytes;
+	rate_stats.qscale		= jpeg_qscale;
+	pthread_mutex_unlock(&rate_stats_lock);
+}
+
+/**
+ * Get the frame size budget and how close the captured frames have come to it
+ * @param[out] stats the target and achieved frame sizes
+ */
+void Camera_get_rate_stats(CAMERA_RATE_STATS * stats)
+{
+	pthread_mutex_lock(&rate_stats_lock);
+	*stats = rate_stats;
+	pthread_mutex_unlock(&rate_stats_lock);
+}
+
+/**
+ * Move the quantisation scale toward the frame budget. JPEG size falls roughly in proportion to
+ * the scale, and stepping halfway to the estimate keeps a single busy frame from swinging the
+ * quality. Frames within the deadband leave the register alone.
+ * @param size the size of the frame just captured, 0 if it was rejected
+ */
+static void rateControl(unsigned int size)
+{
+	if(size == 0 || format != IMG_JPEG) { return; }
+
+	pthread_mutex_lock(&rate_stats_lock);
+	unsigned int target = rate_stats.target_bytes;
+
+	if(target > 0)
+	{
+		rate_stats.frames++;
+		rate_stats.last_bytes = size;
+
+		if(rate_stats.frames == 1) { rate_stats.average_bytes = size; }
+		else
+		{
+			rate_stats.average_bytes = rate_stats.average_bytes -
+									   (rate_stats.average_bytes >> rate_average_shift) +
+									   (size >> rate_average_shift);
+		}
+
+		if(size > target) { rate_stats.over_budget++; }
+	}
+
+	pthread_mutex_unlock(&rate_stats_lock);
+
+	if(target == 0) { return; }
+
+	unsigned int deadband = target / 100 * rate_deadband_percent;
+
+	if(size + deadband >= target && size <= target + deadband) { return; }
+
+	unsigned int qscale = (unsigned int) ((unsigned long long) jpeg_qscale * (size + target) /
+										  (2ULL * target));
+
+	// A small scale rounds back to itself, so always take at least one step
+	if(qscale == jpeg_qscale) { qscale += size > target ? 1 : -1; }
+	if(qscale < rate_qscale_min) { qscale = rate_qscale_min; }
+	if(qscale > rate_qscale_max) { qscale = rate_qscale_max; }
+
+	if(qscale == jpeg_qscale) { return; }
+
+	jpeg_qscale = qscale;
+
+	pthread_mutex_lock(&rate_stats_lock);
+	rate_stats.qscale = qscale;
+	rate_stats.adjustments++;
+	pthread_mutex_unlock(&rate_stats_lock);
+
+	wrSensorReg16_8(jpeg_qscale_reg, qscale);
+}
+
+/**
+ * Step the capture engine between still sizes to hold a frame rate, based on the frame times and
+ * SPI throughput it measures. Takes effect on the next Camera_start_pipeline().
+ * @param target_fps the frame rate to hold, or 0 to keep the current resolution
+ * @param min the smallest resolution to step down to
+ * @param max the largest resolution to step up to
+ */
+void Camera_set_auto_resolution(unsigned int target_fps, RESOLUTION min, RESOLUTION max)
+{
+	if(max > RES_2592x1944) { max = RES_2592x1944; }
+	if(min > max) { min = max; }
+
+	autores_target_fps	 = target_fps;
+	autores_min			 = min;
+	autores_max			 = max;
+	autores_window_count = 0;
+	autores_hold		 = 0;
+	autores_last_up		 = false;
+
+	pthread_mutex_lock(&autores_stats_lock);
+	memset(&autores_stats, 0, sizeof(autores_stats));
+	autores_stats.target_fps	  = target_fps;
+	autores_stats.up_hold_windows = autores_up_hold_min;
+	pthread_mutex_unlock(&autores_stats_lock);
+}
+
+/**
+ * Get the resolution chosen by the automatic resolution controller and the measurements behind it
+ * @param[out] stats the current resolution, frame time, readout and step counts
+ */
+void Camera_get_auto_resolution_stats(CAMERA_AUTORES_STATS * stats)
+{
+	pthread_mutex_lock(&autores_stats_lock);
+	*stats			  = autores_stats;
+	stats->resolution = current_resolution;
+	pthread_mutex_unlock(&autores_stats_lock);
+}
+
+/**
+ * Measure a window of pipeline frames and step the resolution when the frame rate falls below the
+ * target, or when the SPI readout measured at this size predicts the next size up still clears it
+ * with margin. The change is made between draining a frame and triggering the next, writing only
+ * the registers that differ.
+ * @param size the size of the frame just drained
+ * @param readout_us the time taken to read the frame out of the FIFO
+ */
+static void autoResolution(unsigned int size, unsigned long long readout_us)
+{
+	if(autores_target_fps == 0 || current_resolution > RES_2592x1944) { return; }
+
+	if(autores_window_count == 0)
+	{
+		// The first frame of a window only marks its start, a switch leaves it half exposed
+		autores_window_start_us = pipeline_last_frame_us;
+		autores_readout_us		= 0;
+		autores_bytes			= 0;
+		autores_window_count++;
+		return;
+	}
+
+	autores_readout_us += readout_us;
+	autores_bytes += size;
+
+	if(autores_window_count++ < autores_window_frames) { return; }
+
+	unsigned int	   frames	 = autores_window_count - 1;
+	unsigned long long frame_us	 = (pipeline_last_frame_us - autores_window_start_us) / frames;
+	unsigned long long readout	 = autores_readout_us / frames;
+	unsigned long long target_us = 1000000 / autores_target_fps;
+	RESOLUTION		   res		 = current_resolution;
+	RESOLUTION		   next		 = res;
+
+	autores_window_count = 0;
+
+	// The hold windows live in the statistics, so the decision is made under their lock
+	pthread_mutex_lock(&autores_stats_lock);
+	autores_stats.frame_us	 = frame_us;
+	autores_stats.readout_us = readout;
+
+	if(autores_readout_us > 0)
+	{
+		autores_stats.spi_kb_per_sec = autores_bytes * 1000000 / 1024 / autores_readout_us;
+	}
+
+	if(frame_us * autores_down_percent > target_us * 100 && res > autores_min)
+	{
+		next = res - 1;
+		autores_stats.steps_down++;
+
+		if(autores_last_up && autores_stats.up_hold_windows < autores_up_hold_max)
+		{
+			autores_stats.up_hold_windows *= 2;
+		}
+
+		autores_hold	= autores_stats.up_hold_windows;
+		autores_last_up = false;
+	}
+	else if(autores_hold > 0)
+	{
+		// Only steps up wait out the hold, a frame rate under target steps down at once
+		autores_hold--;
+	}
+	else if(res < autores_max)
+	{
+		// Readout grows with the pixel count, the rest of the frame time is taken as fixed
+		unsigned long long pixels	   = resolution_width[res] * resolution_height[res];
+		unsigned long long next_pixels = resolution_width[res + 1] * resolution_height[res + 1];
+		unsigned long long predicted_us = frame_us + readout * (next_pixels - pixels) / pixels;
+
+		if(predicted_us * autores_up_percent <= target_us * 100)
+		{
+			next = res + 1;
+			autores_stats.steps_up++;
+			autores_hold	= 1;
+			autores_last_up = true;
+		}
+		else if(autores_last_up)
+		{
+			// The last step up held, so later ones need not wait as long
+			autores_stats.up_hold_windows = autores_up_hold_min;
+			autores_last_up				  = false;
+		}
+	}
+
+	pthread_mutex_unlock(&autores_stats_lock);
+
+	if(next != res)
+	{
+		DEBUG_PRINTLN("Frame time %llu us against %llu us, switching from %ux%u to %ux%u",
+					  frame_us,
+					  target_us,
+					  resolution_width[res],
+					  resolution_height[res],
+					  resolution_width[next],
+					  resolution_height[next]);
+		Camera_set_resolution(next);
+	}
+}
+
+/**
+ * Get the frame buffer size needed for a JPEG at a given resolution, allowing three bits per
+ * pixel plus room for the headers
+ * @param res the capture resolution
+ * @return the frame capacity in bytes
+ */
+unsigned int Camera_frame_capacity(RESOLUTION res)
+{
+	if(res >= RES_COUNT) { res = RES_2592x1944; }
+
+	unsigned int capacity = resolution_width[res] * resolution_height[res] * 3 / 8;
+	capacity += SPI_BURST_CHUNK_SIZE;
+	capacity = (capacity + SPI_BURST_CHUNK_SIZE - 1) / SPI_BURST_CHUNK_SIZE * SPI_BURST_CHUNK_SIZE;
+
+	return capacity < MAX_FIFO_SIZE ? capacity : MAX_FIFO_SIZE;
+}
+
+/**
+ * Set how many frames the capture paths may hold at once, including the frames handed out to
+ * callers that have not been released yet. Takes effect on the next capture.
+ * @param count the number of frames in the pool
+ */
+void Camera_set_frame_pool_size(unsigned int count)
+{
+	if(count > 0) { frame_pool_size = count; }
+}
+
+/**
+ * Get a pool of count frames sized for the current resolution, replacing the existing pool when
+ * it no longer fits. Frames from the old pool stay valid until their holders release them.
+ * @param count the number of frames needed
+ * @return the pool, or NULL if it could not be allocated
+ */
+static FRAME_POOL * useFramePool(unsigned int count)
+{
+	unsigned int capacity = Camera_frame_capacity(current_resolution);
+
+	// Automatic resolution switches while the pipeline runs, so frames fit the largest size
+	if(autores_target_fps > 0 && Camera_frame_capacity(autores_max) > capacity)
+	{
+		capacity = Camera_frame_capacity(autores_max);
+	}
+
+	if(frame_pool != NULL &&
+	   (FramePool_capacity(frame_pool) != capacity || FramePool_count(frame_pool) != count))
+	{
+		FramePool_destroy(frame_pool);
+		frame_pool = NULL;
+	}
+
+	if(frame_pool == NULL) { frame_pool = FramePool_create(count, capacity); }
+
+	return frame_pool;
+}
+
+/**
+ * Capture a single image into a frame from the pool
+ */
+void Camera_single_capture()
+{
+	FramePool_release(capture_frame);
+	capture_frame = NULL;
+
+	FRAME_POOL * pool = useFramePool(frame_pool_size);
+	if(pool != NULL) { capture_frame = FramePool_acquire(pool); }
+
+	if(capture_frame == NULL)
+	{
+		ERROR_PRINTLN("No free frame buffer for the capture");
+		return;
+	}
+
+	// Flushing the FIFO also clears the capture done flag
+	flushFIFO();
+	Camera_start_capture();
+
+	waitForCapture();
+
+	capture_frame->timestamp_us = Timer_now_us();
+	rateControl(drainFIFO(capture_frame));
+
+	capture_timing.capture_us = capture_frame->timestamp_us - capture_trigger_us;
+	capture_timing.drain_us	  = Timer_now_us() - capture_frame->timestamp_us;
+	capture_timing.size		  = capture_frame->size;
+
+	DEBUG_PRINTLN("Single image captured, size: %u bytes", capture_frame->size);
+}
+
+/**
+ * Get a reference to the most recent capture, which stays valid after later captures
+ * @return the capture, to be released with FramePool_release(), or NULL if there is none
+ */
+CAMERA_FRAME * Camera_get_capture_frame()
+{
+	return capture_frame != NULL ? FramePool_retain(capture_frame) : NULL;
+}
+
+/**
+ * Start the double buffered capture engine. Each Camera_pipeline_next() drains the finished
+ * frame into a pool buffer and immediately triggers the next capture, so downstream work on a
+ * frame overlaps the exposure of the one after it.
+ * @return 0 on success or -1 on failure
+ */
+int Camera_start_pipeline()
+{
+	Camera_stop_pipeline();
+	Camera_stop_multi();
+
+	// Zero shutter lag pins the latest frame, which is one frame fewer for the pipeline
+	if(useFramePool(frame_pool_size + (zsl_enabled ? 1 : 0)) == NULL) { return -1; }
+
+	pipeline_sequence		 = 0;
+	pipeline_running		 = true;
+	pipeline_trigger_pending = false;
+	autores_window_count	 = 0;
+
+	writeRegister(ARDUCHIP_FRAMES, 0x00);
+	flushFIFO();
+	Camera_start_capture();
+
+	return 0;
+}
+
+/**
+ * Wait for the capture in flight, drain it, trigger the next one and return the drained frame.
+ * When every pool frame is still held downstream or the JPEG is damaged the capture is dropped.
+ * @return the captured frame, to be released with FramePool_release(), or NULL if the pipeline
+ * is not running, no frame buffer was free or the capture was rejected
+ */
+CAMERA_FRAME * Camera_pipeline_next()
+{
+	if(!pipeline_running) { return NULL; }
+
+	if(pipeline_trigger_pending) { triggerPaced(); }
+
+	waitForCapture();
+
+	CAMERA_FRAME * frame = FramePool_acquire(frame_pool);
+
+	pipeline_last_frame_us	  = Timer_now_us();
+	capture_timing.capture_us = pipeline_last_frame_us - capture_trigger_us;
+	capture_timing.drain_us	  = 0;
+	capture_timing.size		  = 0;
+
+	if(frame != NULL)
+	{
+		frame->timestamp_us = pipeline_last_frame_us;
+		frame->sequence		= pipeline_sequence;
+
+		if(drainFIFO(frame) == 0)
+		{
+			FramePool_release(frame);
+			frame = NULL;
+		}
+		else
+		{
+			capture_timing.drain_us = Timer_now_us() - pipeline_last_frame_us;
+			capture_timing.size		= frame->size;
+
+			rateControl(frame->size);
+			autoResolution(frame->size, capture_timing.drain_us);
+		}
+	}
+	else
+	{
+		ERROR_PRINTLN("No free frame buffer, dropping pipeline frame %lu", pipeline_sequence);
+	}
+
+	// The preview is back once the first frame after a snapshot is out
+	if(snapshot_gap_pending && frame != NULL)
+	{
+		unsigned long long gap_us = frame->timestamp_us - snapshot_gap_start_us;
+		snapshot_gap_pending	  = false;
+
+		pthread_mutex_lock(&snapshot_stats_lock);
+		snapshot_stats.last_preview_gap_us = gap_us;
+
+		if(gap_us > snapshot_stats.max_preview_gap_us)
+		{
+			snapshot_stats.max_preview_gap_us = gap_us;
+		}
+
+		pthread_mutex_unlock(&snapshot_stats_lock);
+	}
+
+	pipeline_sequence++;
+
+	// Trigger frame N + 1 before handing frame N downstream, unless a video preset is ahead of its
+	// frame rate, in which case the trigger waits for the next call
+	if(pipeline_interval_us > 0 && Timer_now_us() < capture_trigger_us + pipeline_interval_us)
+	{
+		pipeline_trigger_pending = true;
+	}
+	else
+	{
+		flushFIFO();
+		Camera_start_capture();
+	}
+
+	if(zsl_enabled && frame != NULL) { keepLatestFrame(frame); }
+
+	return frame;
+}
+
+/**
+ * Stop the double buffered capture engine
+ */
+void Camera_stop_pipeline()
+{
+	if(pipeline_running && !pipeline_trigger_pending)
+	{
+		// Let the capture in flight finish so the FIFO is idle for the next user
+		waitForCapture();
+		flushFIFO();
+	}
+
+	pipeline_running		 = false;
+	pipeline_trigger_pending = false;
+
+	// A still from before the pipeline stopped would no longer be zero shutter lag
+	keepLatestFrame(NULL);
+}
+
+/**
+ * Open another ArduCAM on the SPI bus given to Camera_init(). Its sensor shares the I2C bus with
+ * the first camera and takes every setting made through this module.
+ * @param spi_cs The chip select the camera's ArduCHIP is wired to
+ * @return the camera, to be closed with Camera_close(), or NULL if it does not answer
+ */
+CAMERA * Camera_open(unsigned int spi_cs)
+{
+	int device = SPI_add_device(spi_cs);
+	if(device < 0) { return NULL; }
+
+	SPI_select(device);
+	writeRegister(ARDUCHIP_TEST1, 0x55);
+
+	bool online = readRegister(ARDUCHIP_TEST1) == 0x55;
+
+	if(online)
+	{
+		writeRegister(ARDUCHIP_FRAMES, 0x00);
+		flushFIFO();
+	}
+
+	SPI_select(0);
+
+	if(!online)
+	{
+		ERROR_PRINTLN("No ArduCHIP answering on chip select %u", spi_cs);
+		return NULL;
+	}
+
+	CAMERA * camera = calloc(1, sizeof(CAMERA));
+	if(camera == NULL) { return NULL; }
+
+	camera->spi_device = device;
+	camera->spi_cs	   = spi_cs;
+
+	return camera;
+}
+
+/**
+ * Free a camera from Camera_open(). Its chip select stays open until Camera_shutdown().
+ * @param camera the camera, which must not be in a running Camera_start_multi() set
+ */
+void Camera_close(CAMERA * camera) { free(camera); }
+
+/**
+ * Start capturing from several cameras at once. The triggers are staggered by the time each
+ * register write takes, and from then on every camera is triggered again as soon as its FIFO is
+ * drained, so it exposes while the others are read out.
+ * @param cameras the cameras to capture from
+ * @param count the number of cameras, at most CAMERA_MAX_INSTANCES
+ * @return 0 on success or -1 if the count is out of range or the frame pool could not be made
+ */
+int Camera_start_multi(CAMERA ** cameras, unsigned int count)
+{
+	Camera_stop_zsl();
+	Camera_stop_pipeline();
+	Camera_stop_multi();
+
+	if(count == 0 || count > CAMERA_MAX_INSTANCES) { return -1; }
+
+	// Each camera may have a frame held downstream on top of the usual pool
+	if(useFramePool(frame_pool_size + count) == NULL) { return -1; }
+
+	memset(&multi_stats, 0, sizeof(multi_stats));
+	multi_stats.cameras = count;
+	multi_count			= count;
+	multi_next			= 0;
+	multi_running		= true;
+
+	for(unsigned int i = 0; i < count; i++)
+	{
+		multi_cameras[i]		   = cameras[i];
+		multi_cameras[i]->sequence = 0;
+		triggerCamera(multi_cameras[i]);
+	}
+
+	return 0;
+}
+
+/**
+ * Wait for the next camera to finish a capture, drain it, trigger it again and return its frame.
+ * Cameras are checked in turn starting after the one drained last, so a fast camera cannot starve
+ * the others, and the wait sleeps until the earliest capture is expected to finish.
+ * @param[out] index the position in the Camera_start_multi() set of the camera the frame is from
+ * @return the frame, to be released with FramePool_release(), or NULL if capture is not running,
+ * no frame buffer was free or the capture was rejected
+ */
+CAMERA_FRAME * Camera_multi_next(unsigned int * index)
+{
+	if(!multi_running) { return NULL; }
+
+	unsigned long long wait_start_us = Timer_now_us();
+	unsigned int	   expected_us	 = wait_expected_us[current_resolution][wait_exposure_bucket];
+
+	if(wait_adaptive && expected_us > wait_wake_margin_us)
+	{
+		unsigned long long wake_us = multi_cameras[0]->trigger_us;
+
+		for(unsigned int i = 1; i < multi_count; i++)
+		{
+			if(multi_cameras[i]->trigger_us < wake_us) { wake_us = multi_cameras[i]->trigger_us; }
+		}
+
+		wake_us += expected_us - wait_wake_margin_us;
+		if(wake_us > wait_start_us) { Timer_delay_us(wake_us - wait_start_us); }
+	}
+
+	bool polled_busy[CAMERA_MAX_INSTANCES] = {false};
+
+	while(1)
+	{
+		for(unsigned int i = 0; i < multi_count; i++)
+		{
+			unsigned int position = (multi_next + i) % multi_count;
+			CAMERA *	 camera	  = multi_cameras[position];
+
+			SPI_select(camera->spi_device);
+			multi_stats.polls++;
+
+			if(!getBit(ARDUCHIP_TRIG, CAP_DONE_MASK))
+			{
+				polled_busy[position] = true;
+				continue;
+			}
+
+			// A camera seen busy on the last poll finished within one poll, which times the
+			// capture closely enough to learn from
+			if(polled_busy[position])
+			{
+				unsigned int * expected = wait_expected_us[current_resolution];
+				unsigned int   measured = Timer_now_us() - camera->trigger_us;
+
+				expected += wait_exposure_bucket;
+
+				*expected = *expected == 0 ? measured : (*expected * 7 + measured) / 8;
+			}
+
+			multi_stats.wait_us += Timer_now_us() - wait_start_us;
+			multi_next = (position + 1) % multi_count;
+			*index	   = position;
+
+			return drainCamera(position);
+		}
+
+		Timer_delay_us(wait_fine_poll_us);
+	}
+}
+
+/**
+ * Stop capturing from the cameras given to Camera_start_multi(), letting each finish the capture
+ * in flight so its FIFO is idle, and go back to the first camera
+ */
+void Camera_stop_multi()
+{
+	if(!multi_running) { return; }
+
+	for(unsigned int i = 0; i < multi_count; i++)
+	{
+		SPI_select(multi_cameras[i]->spi_device);
+
+		while(multi_cameras[i]->triggered && !getBit(ARDUCHIP_TRIG, CAP_DONE_MASK))
+		{
+			Timer_delay_us(wait_fine_poll_us);
+		}
+
+		flushFIFO();
+		multi_cameras[i]->triggered = false;
+	}
+
+	SPI_select(0);
+	multi_running = false;
+	multi_count	  = 0;
+}
+
+/**
+ * Get the frame counts and bus time of the cameras given to Camera_start_multi()
+ * @param[out] stats the frames from each camera, the drops and the time spent waiting and draining
+ */
+void Camera_get_multi_stats(CAMERA_MULTI_STATS * stats) { *stats = multi_stats; }
+
+/**
+ * Clear a camera's FIFO and start its next capture
+ * @param camera the camera to trigger
+ */
+static void triggerCamera(CAMERA * camera)
+{
+	SPI_select(camera->spi_device);
+	flushFIFO();
+	Camera_start_capture();
+
+	camera->trigger_us = capture_trigger_us;
+	camera->triggered  = true;
+}
+
+/**
+ * Read a finished capture out of one camera's FIFO and trigger that camera again
+ * @param index the position of the camera in the running set, already selected on the bus
+ * @return the frame, or NULL if no frame buffer was free or the capture was rejected
+ */
+static CAMERA_FRAME * drainCamera(unsigned int index)
+{
+	CAMERA *		   camera	= multi_cameras[index];
+	CAMERA_FRAME *	   frame	= FramePool_acquire(frame_pool);
+	unsigned long long start_us = Timer_now_us();
+
+	if(frame != NULL)
+	{
+		frame->timestamp_us = start_us;
+		frame->sequence		= camera->sequence;
+
+		if(drainFIFO(frame) == 0)
+		{
+			FramePool_release(frame);
+			frame = NULL;
+		}
+		else
+		{
+			rateControl(frame->size);
+		}
+	}
+	else
+	{
+		ERROR_PRINTLN("No free frame buffer, dropping frame %lu from camera %u",
+					  camera->sequence,
+					  index);
+	}
+
+	multi_stats.drain_us += Timer_now_us() - start_us;
+	camera->sequence++;
+
+	// This camera exposes its next frame while the others are read out
+	triggerCamera(camera);
+
+	if(frame == NULL) { multi_stats.dropped++; }
+	else
+	{
+		multi_stats.frames++;
+		multi_stats.camera_frames[index]++;
+	}
+
+	return frame;
+}
+
+/**
+ * Trigger the next pipeline capture once the video frame interval since the last one has passed
+ */
+static void triggerPaced()
+{
+	unsigned long long due_us = capture_trigger_us + pipeline_interval_us;
+	unsigned long long now_us = Timer_now_us();
+
+	if(due_us > now_us) { Timer_delay_us(due_us - now_us); }
+
+	flushFIFO();
+	Camera_start_capture();
+	pipeline_trigger_pending = false;
+}
+
+/**
+ * Capture a burst of frames back to back into buffers allocated before the first trigger, so
+ * nothing allocates or touches storage until the burst is over. The resolution is restored
+ * afterwards. No other capture path may be running.
+ * @param count the number of frames to capture
+ * @param res the burst resolution
+ * @param[out] frames filled with the frames, each to be released with FramePool_release()
+ * @param[out] intervals_us filled with the time from the trigger to the first frame and then from
+ * each frame to the next, may be NULL
+ * @return the number of frames captured, fewer than count if captures kept being rejected, or -1
+ * if the buffers could not be allocated
+ */
+int Camera_burst_capture(unsigned int		  count,
+						 RESOLUTION			  res,
+						 CAMERA_FRAME **	  frames,
+						 unsigned long long * intervals_us)
+{
+	RESOLUTION	 previous_resolution = current_resolution;
+	unsigned int captured			 = 0;
+	unsigned int attempts			 = 0;
+
+	if(count == 0) { return 0; }
+
+	Camera_stop_pipeline();
+
+	if(res != current_resolution) { Camera_set_resolution(res); }
+
+	// The burst has a pool of its own, freed once the caller has flushed the last frame
+	FRAME_POOL * pool = FramePool_create(count, Camera_frame_capacity(res));
+
+	if(pool == NULL)
+	{
+		if(res != previous_resolution) { Camera_set_resolution(previous_resolution); }
+		return -1;
+	}
+
+	writeRegister(ARDUCHIP_FRAMES, 0x00);
+	flushFIFO();
+	Camera_start_capture();
+
+	unsigned long long previous_us = capture_trigger_us;
+
+	// A rejected capture is retried, up to the length of the burst again
+	while(captured < count && attempts < 2 * count)
+	{
+		attempts++;
+		waitForCapture();
+
+		CAMERA_FRAME * frame = FramePool_acquire(pool);
+		frame->timestamp_us	 = Timer_now_us();
+		frame->sequence		 = captured;
+
+		bool valid = drainFIFO(frame) > 0;
+
+		// Trigger the next frame before recording this one
+		if(captured + valid < count && attempts < 2 * count)
+		{
+			flushFIFO();
+			Camera_start_capture();
+		}
+
+		if(!valid)
+		{
+			FramePool_release(frame);
+			continue;
+		}
+
+		if(intervals_us != NULL) { intervals_us[captured] = frame->timestamp_us - previous_us; }
+
+		previous_us		   = frame->timestamp_us;
+		frames[captured++] = frame;
+	}
+
+	FramePool_destroy(pool);
+
+	if(res != previous_resolution) { Camera_set_resolution(previous_resolution); }
+
+	DEBUG_PRINTLN("Burst of %u frames captured in %u attempts", captured, attempts);
+	return captured;
+}
+
+/**
+ * Take one 2592x1944 JPEG and go back to the streaming resolution. Only the registers the capture
+ * table changes are written, and on the way back only those that now differ from what streaming
+ * had. A running pipeline is paused for the snapshot and resumed afterwards, and the time until
+ * its next frame is reported as the preview gap.
+ * @return the snapshot, to be released with FramePool_release(), or NULL if the capture failed
+ */
+CAMERA_FRAME * Camera_snapshot()
+{
+	bool			   resume_pipeline	 = pipeline_running;
+	unsigned long	   resume_sequence	 = pipeline_sequence;
+	RESOLUTION		   stream_resolution = current_resolution;
+	CAMERA_FRAME *	   frame			 = NULL;
+	unsigned long long start_us;
+	unsigned int	   registers_switched, registers_restored;
+	unsigned long long switch_us, capture_us, restore_us;
+
+	if(snapshot_pool == NULL)
+	{
+		snapshot_pool = FramePool_create(SNAPSHOT_POOL_SIZE, Camera_frame_capacity(RES_2592x1944));
+		if(snapshot_pool == NULL) { return NULL; }
+	}
+
+	Camera_stop_pipeline();
+	snapshot_gap_start_us = resume_pipeline ? pipeline_last_frame_us : Timer_now_us();
+
+	start_us = Timer_now_us();
+	saveSnapshotRegisters(OV5642_JPEG_Capture_QSXGA);
+	registers_switched = writeSensorDelta(OV5642_JPEG_Capture_QSXGA);
+	switch_us		   = Timer_now_us() - start_us;
+
+	// The capture wait is learned separately for the full resolution
+	current_resolution = RES_2592x1944;
+	start_us		   = Timer_now_us();
+
+	// The first frame after the switch can be cut short, so a rejected capture is retried
+	for(int attempt = 0; attempt < SNAPSHOT_ATTEMPTS && frame == NULL; attempt++)
+	{
+		frame = FramePool_acquire(snapshot_pool);
+		if(frame == NULL) { break; }
+
+		writeRegister(ARDUCHIP_FRAMES, 0x00);
+		flushFIFO();
+		Camera_start_capture();
+		waitForCapture();
+
+		frame->timestamp_us = Timer_now_us();
+		frame->sequence		= snapshot_stats.snapshots;
+
+		if(drainFIFO(frame) == 0)
+		{
+			FramePool_release(frame);
+			frame = NULL;
+		}
+	}
+
+	capture_us		   = Timer_now_us() - start_us;
+	current_resolution = stream_resolution;
+
+	start_us		   = Timer_now_us();
+	registers_restored = writeSensorDelta(snapshot_saved);
+	restore_us		   = Timer_now_us() - start_us;
+
+	pthread_mutex_lock(&snapshot_stats_lock);
+	snapshot_stats.registers_switched = registers_switched;
+	snapshot_stats.switch_us		  = switch_us;
+	snapshot_stats.capture_us		  = capture_us;
+	snapshot_stats.registers_restored = registers_restored;
+	snapshot_stats.restore_us		  = restore_us;
+	if(frame != NULL) { snapshot_stats.snapshots++; }
+	pthread_mutex_unlock(&snapshot_stats_lock);
+
+	if(frame == NULL) { ERROR_PRINTLN("Snapshot capture failed"); }
+
+	if(resume_pipeline && Camera_start_pipeline() == 0)
+	{
+		pipeline_sequence	 = resume_sequence;
+		snapshot_gap_pending = true;
+	}
+
+	DEBUG_PRINTLN("Snapshot switch %llu us (%u registers), capture %llu us, restore %llu us (%u "
+				  "registers)",
+				  switch_us,
+				  registers_switched,
+				  capture_us,
+				  restore_us,
+				  registers_restored);
+
+	return frame;
+}
+
+/**
+ * Get the register counts and timings of the last snapshot and the preview gaps it caused
+ * @param[out] stats filled with the snapshot statistics
+ */
+void Camera_get_snapshot_stats(CAMERA_SNAPSHOT_STATS * stats)
+{
+	pthread_mutex_lock(&snapshot_stats_lock);
+	*stats = snapshot_stats;
+	pthread_mutex_unlock(&snapshot_stats_lock);
+}
+
+/**
+ * Save the current value of every register a table writes, reading any the shadow does not
+ * know, into a table that puts them back. Reset pulses are left out and the compression block is
+ * reset once the restored registers are in.
+ * @param reglist the table about to be written
+ */
+static void saveSnapshotRegisters(const struct sensor_reg * reglist)
+{
+	snapshot_saved_count = 0;
+
+	for(const struct sensor_reg * next = reglist; next->reg != 0xffff || next->val != 0xff; next++)
+	{
+		unsigned int reg   = next->reg;
+		bool		 saved = reg >= 0x3000 && reg <= 0x3003;
+
+		for(unsigned int i = 0; i < snapshot_saved_count && !saved; i++)
+		{
+			saved = snapshot_saved[i].reg == reg;
+		}
+
+		if(saved || snapshot_saved_count >= SNAPSHOT_MAX_REGISTERS - 3) { continue; }
+
+		// Readouts that move on their own are read fresh, the rest come from the shadow
+		if(shadowIsVolatile(reg) || !(sensor_shadow_valid[reg / 8] & (1 << (reg % 8))))
+		{
+			unsigned char value;
+			rdSensorReg16_8(reg, &value);
+			shadowRecord(reg, value);
+		}
+
+		snapshot_saved[snapshot_saved_count].reg   = reg;
+		snapshot_saved[snapshot_saved_count++].val = sensor_shadow[reg];
+	}
+
+	snapshot_saved[snapshot_saved_count++] = (struct sensor_reg) {0x3002, 0x0c};
+	snapshot_saved[snapshot_saved_count++] = (struct sensor_reg) {0x3002, 0x00};
+	snapshot_saved[snapshot_saved_count]   = (struct sensor_reg) {0xffff, 0xff};
+}
+
+/**
+ * Write a register table, skipping registers the shadow shows already hold the value. Command
+ * registers and readouts that move on their own are always written.
+ * @param reglist the register table, ending with 0xffff
+ * @return the number of registers written
+ */
+static unsigned int writeSensorDelta(const struct sensor_reg * reglist)
+{
+	unsigned int written = 0;
+
+	for(const struct sensor_reg * next = reglist; next->reg != 0xffff || next->val != 0xff; next++)
+	{
+		if(!shadowIsCommand(next->reg) && !shadowIsVolatile(next->reg) &&
+		   shadowMatches(next->reg, next->val))
+		{
+			continue;
+		}
+
+		wrSensorReg16_8(next->reg, next->val);
+		written++;
+	}
+
+	return written;
+}
+
+/**
+ * Keep the latest frame from the capture pipeline, whoever runs it, so a still can be taken at
+ * any moment without waiting for a capture
+ * @param enabled true to keep the latest frame, which takes one more frame from the pool
+ */
+void Camera_set_zsl(bool enabled)
+{
+	zsl_enabled = enabled;
+
+	if(!enabled) { keepLatestFrame(NULL); }
+}
+
+/**
+ * Start zero shutter lag capture, which keeps the pipeline re-triggering from a background thread
+ * so the latest frame is never more than a frame old. No other capture call may be made until
+ * Camera_stop_zsl().
+ * @return 0 on success or -1 if the pipeline or its thread could not be started
+ */
+int Camera_start_zsl()
+{
+	if(zsl_running) { return 0; }
+
+	Camera_set_zsl(true);
+
+	if(!pipeline_running && Camera_start_pipeline() < 0) { return -1; }
+
+	zsl_running = true;
+
+	if(pthread_create(&zsl_thread, NULL, zslThread, NULL) != 0)
+	{
+		ERROR_PRINTLN("Unable to start the zero shutter lag thread");
+		zsl_running = false;
+		return -1;
+	}
+
+	DEBUG_PRINTLN("Zero shutter lag capture running");
+	return 0;
+}
+
+/**
+ * Stop the zero shutter lag thread. The pipeline keeps running so the caller can take it over
+ * with Camera_pipeline_next() without missing a frame, or stop it with Camera_stop_pipeline().
+ */
+void Camera_stop_zsl()
+{
+	if(!zsl_running) { return; }
+
+	__atomic_store_n(&zsl_running, false, __ATOMIC_RELEASE);
+	pthread_join(zsl_thread, NULL);
+}
+
+/**
+ * Take a still with zero shutter lag by handing out the most recent completed frame, stamped with
+ * the time its capture finished. Safe to call from any thread while the pipeline runs.
+ * @param request_us when the still was asked for, such as the press time, for the lag statistics
+ * @return the still, to be released with FramePool_release(), or NULL if no frame is held
+ */
+CAMERA_FRAME * Camera_zsl_capture(unsigned long long request_us)
+{
+	pthread_mutex_lock(&zsl_lock);
+
+	CAMERA_FRAME *	   frame = zsl_latest != NULL ? FramePool_retain(zsl_latest) : NULL;
+	unsigned long long now	 = Timer_now_us();
+
+	if(frame == NULL) { zsl_stats.misses++; }
+	else
+	{
+		unsigned long long latency_us = now > request_us ? now - request_us : 0;
+		unsigned long long age_us =
+			request_us > frame->timestamp_us ? request_us - frame->timestamp_us : 0;
+
+		zsl_stats.stills++;
+		zsl_stats.last_latency_us = latency_us;
+		zsl_stats.last_age_us	  = age_us;
+		zsl_latency_total_us += latency_us;
+		zsl_stats.average_latency_us = zsl_latency_total_us / zsl_stats.stills;
+
+		if(latency_us > zsl_stats.max_latency_us) { zsl_stats.max_latency_us = latency_us; }
+		if(age_us > zsl_stats.max_age_us) { zsl_stats.max_age_us = age_us; }
+	}
+
+	pthread_mutex_unlock(&zsl_lock);
+	return frame;
+}
+
+/**
+ * Get the request to still latency and the age of the stills handed out
+ * @param[out] stats filled with the zero shutter lag statistics
+ */
+void Camera_get_zsl_stats(CAMERA_ZSL_STATS * stats)
+{
+	pthread_mutex_lock(&zsl_lock);
+	*stats = zsl_stats;
+	pthread_mutex_unlock(&zsl_lock);
+}
+
+/**
+ * Replace the frame held for zero shutter lag stills
+ * @param frame the new latest frame, retained here, or NULL to hold none
+ */
+static void keepLatestFrame(CAMERA_FRAME * frame)
+{
+	if(frame != NULL) { FramePool_retain(frame); }
+
+	pthread_mutex_lock(&zsl_lock);
+	CAMERA_FRAME * previous = zsl_latest;
+	zsl_latest				= frame;
+	pthread_mutex_unlock(&zsl_lock);
+
+	FramePool_release(previous);
+}
+
+/**
+ * Zero shutter lag capture loop, re-triggers the pipeline until Camera_stop_zsl()
+ * @param arg unused
+ * @return NULL
+ */
+static void * zslThread(void * arg)
+{
+	while(__atomic_load_n(&zsl_running, __ATOMIC_ACQUIRE))
+	{
+		FramePool_release(Camera_pipeline_next());
+	}
+
+	return NULL;
+}
+
+/**
+ * Read a finished capture out of the FIFO into a frame. JPEG captures are validated and trimmed
+ * to the image, dropping the dummy byte clocked out ahead of it and the FIFO padding after it.
+ * @param[out] frame the frame to read into, its size is 0 if the capture was rejected
+ * @return the frame size in bytes, or 0 on failure
+ */
+static unsigned int drainFIFO(CAMERA_FRAME * frame)
+{
+	unsigned int count = readFIFOLength();
+
+	frame->size	  = 0;
+	frame->width  = 0;
+	frame->height = 0;
+
+	if(count > frame->capacity)
+	{
+		ERROR_PRINTLN("Capture of %u bytes does not fit the %u byte buffer",
+					  count,
+					  frame->capacity);
+		count = frame->capacity;
+	}
+
+	if(readFIFOBurst(frame->data, count) < 0) { return 0; }
+
+	if(format != IMG_JPEG)
+	{
+		frame->size = count;
+		return count;
+	}
+
+	JPEG_INFO	jpeg;
+	JPEG_STATUS status = JPEG_validate(frame->data, count, &jpeg);
+
+	if(status != JPEG_VALID)
+	{
+		ERROR_PRINTLN("Rejected a %u byte capture: %s", count, JPEG_status_name(status));
+		frames_rejected++;
+		return 0;
+	}
+
+	if(jpeg.start > 0) { memmove(frame->data, frame->data + jpeg.start, jpeg.end - jpeg.start); }
+
+	frame->size	  = jpeg.end - jpeg.start;
+	frame->width  = jpeg.width;
+	frame->height = jpeg.height;
+
+	return frame->size;
+}
+
+/**
+ * Get how long the last single or pipeline capture took to expose and to read out of the FIFO. In
+ * the pipeline the capture time runs from the trigger made at the previous frame.
+ * @param[out] timing the capture and drain times and the frame size, 0 if it was rejected
+ */
+void Camera_get_capture_timing(CAMERA_CAPTURE_TIMING * timing) { *timing = capture_timing; }
+
+/**
+ * Get the number of captures rejected as damaged or truncated JPEGs
+ * @return the rejected frame count since the library was loaded
+ */
+unsigned long Camera_rejected_frames() { return frames_rejected; }
+
+/**
+ * Start continuous capture, where each trigger makes the ArduCHIP store several frames back to
+ * back in its FIFO and a single burst drain fills a ring of frames from the pool
+ * @param ring_size the number of frames the ring holds, must be more than frames_per_trigger
+ * @param frames_per_trigger the number of frames captured per trigger, 1 to 7
+ * @return 0 on success or -1 on failure
+ */
+int Camera_start_stream(unsigned int ring_size, unsigned int frames_per_trigger)
+{
+	if(frames_per_trigger < 1 || frames_per_trigger > STREAM_MAX_FRAMES_PER_TRIGGER ||
+	   ring_size <= frames_per_trigger)
+	{
+		ERROR_PRINTLN("Invalid stream of %u frames per trigger into %u buffers",
+					  frames_per_trigger,
+					  ring_size);
+		return -1;
+	}
+
+	Camera_stop_stream();
+
+	// Frames handed out by Camera_stream_next() still count against the pool
+	stream_ring			= calloc(ring_size, sizeof(CAMERA_FRAME *));
+	stream_staging_size = frames_per_trigger * Camera_frame_capacity(current_resolution);
+
+	if(stream_staging_size > MAX_FIFO_SIZE) { stream_staging_size = MAX_FIFO_SIZE; }
+
+	stream_staging = malloc(stream_staging_size);
+
+	if(stream_ring == NULL || stream_staging == NULL ||
+	   useFramePool(ring_size + frame_pool_size) == NULL)
+	{
+		ERROR_PRINTLN("Unable to allocate stream buffers");
+		Camera_stop_stream();
+		return -1;
+	}
+
+	stream_ring_size = ring_size;
+
+	stream_ring_head		  = 0;
+	stream_ring_count		  = 0;
+	stream_frames_per_trigger = frames_per_trigger;
+	stream_sequence			  = 0;
+	stream_dropped			  = 0;
+
+	// The register holds the number of extra frames after the first
+	writeRegister(ARDUCHIP_FRAMES, frames_per_trigger - 1);
+
+	DEBUG_PRINTLN("Streaming %u frames per trigger into %u buffers", frames_per_trigger, ring_size);
+	return 0;
+}
+
+/**
+ * Get the next frame from the stream, triggering and draining another batch when the ring is
+ * empty
+ * @return the next frame, to be released with FramePool_release(), or NULL if the stream is not
+ * running or capture failed
+ */
+CAMERA_FRAME * Camera_stream_next()
+{
+	if(stream_ring == NULL) { return NULL; }
+
+	for(int attempt = 0; stream_ring_count == 0 && attempt < 3; attempt++)
+	{
+		if(captureStreamBatch() < 0) { return NULL; }
+	}
+
+	if(stream_ring_count == 0) { return NULL; }
+
+	CAMERA_FRAME * frame = stream_ring[stream_ring_head];
+	stream_ring_head	 = (stream_ring_head + 1) % stream_ring_size;
+	stream_ring_count--;
+
+	return frame;
+}
+
+/**
+ * Get the number of frames the stream has lost to an empty pool, oversized frames or short batches
+ * @return the dropped frame count since the stream started
+ */
+unsigned long Camera_stream_dropped() { return stream_dropped; }
+
+/**
+ * Stop continuous capture, release the frames left in the ring and return to single frame
+ * captures
+ */
+void Camera_stop_stream()
+{
+	if(stream_ring != NULL)
+	{
+		for(unsigned int i = 0; i < stream_ring_count; i++)
+		{
+			FramePool_release(stream_ring[(stream_ring_head + i) % stream_ring_size]);
+		}
+
+		writeRegister(ARDUCHIP_FRAMES, 0x00);
+	}
+
+	free(stream_ring);
+	free(stream_staging);
+
+	stream_ring		  = NULL;
+	stream_staging	  = NULL;
+	stream_ring_size  = 0;
+	stream_ring_count = 0;
+}
+
+/**
+ * Trigger one multi-frame capture, drain the whole FIFO in bursts and split it into frames
+ * @return the number of frames added to the ring, or -1 on a bus failure
+ */
+static int captureStreamBatch()
+{
+	unsigned long long trigger_us = Timer_now_us();
+
+	flushFIFO();
+	Camera_start_capture();
+
+	waitForCapture();
+
+	unsigned long long done_us = Timer_now_us();
+	unsigned int	   length  = readFIFOLength();
+
+	if(length > stream_staging_size)
+	{
+		ERROR_PRINTLN("Stream batch of %u bytes does not fit the staging buffer", length);
+		length = stream_staging_size;
+	}
+
+	if(readFIFOBurst(stream_staging, length) < 0) { return -1; }
+
+	unsigned int offset = 0, added = 0;
+	JPEG_INFO	 jpeg;
+
+	while(added < stream_frames_per_trigger && offset < length)
+	{
+		JPEG_STATUS status = JPEG_validate(stream_staging + offset, length - offset, &jpeg);
+
+		if(status == JPEG_NO_START) { break; }
+
+		// Resynchronise on the next start of image after a damaged frame
+		if(status != JPEG_VALID)
+		{
+			ERROR_PRINTLN("Rejected stream frame %lu: %s",
+						  stream_sequence,
+						  JPEG_status_name(status));
+			frames_rejected++;
+			stream_sequence++;
+			added++;
+			offset += jpeg.start + 2;
+			continue;
+		}
+
+		unsigned int size = jpeg.end - jpeg.start;
+		rateControl(size);
+
+		// A batch is only drained into an empty ring, which holds more than a batch, so there is
+		// always room for the frame
+		CAMERA_FRAME * frame = FramePool_acquire(frame_pool);
+
+		if(frame == NULL || size > frame->capacity)
+		{
+			FramePool_release(frame);
+			stream_dropped++;
+		}
+		else
+		{
+			stream_ring[(stream_ring_head + stream_ring_count) % stream_ring_size] = frame;
+
+			memcpy(frame->data, stream_staging + offset + jpeg.start, size);
+			frame->size		= size;
+			frame->width	= jpeg.width;
+			frame->height	= jpeg.height;
+			frame->sequence = stream_sequence;
+
+			// Frames in a batch are only timed as a group, so spread them over the capture
+			frame->timestamp_us =
+				trigger_us + (done_us - trigger_us) * (added + 1) / stream_frames_per_trigger;
+
+			stream_ring_count++;
+		}
+
+		stream_sequence++;
+		added++;
+		offset += jpeg.end;
+	}
+
+	if(added < stream_frames_per_trigger) { stream_dropped += stream_frames_per_trigger - added; }
+
+	return added;
+}
+
+/**
+ * Save the most recent camera capture to a given file
+ * @param filename the name of the file to save to
+ */
+void Camera_save_capture_to_file(const char * filename)
 {
 	FILE * output_file = fopen(filename, "w");
 
@@ -481,7 +2922,11 @@ void Camera_save_capture_to_file(const char * filename)
 		return;
 	}
 
-	fwrite(read_buffer, sizeof(char), current_jpeg_buffer_size, output_file);
+	if(capture_frame != NULL)
+	{
+		fwrite(capture_frame->data, sizeof(char), capture_frame->size, output_file);
+	}
+
 	fflush(output_file);
 
 	if(fclose(output_file) < 0) { ERROR_PRINTLN("Failed to close the image file"); }
@@ -489,6 +2934,23 @@ void Camera_save_capture_to_file(const char * filename)
 	DEBUG_PRINTLN("Saved last capture to file: %50s", filename);
 }
 
+/**
+ * Get the most recent camera capture without copying it
+ * @param[out] data pointer to the capture bytes, valid until the next capture
+ * @return the size of the capture in bytes
+ */
+int Camera_get_capture(const char ** data)
+{
+	if(capture_frame == NULL)
+	{
+		*data = NULL;
+		return 0;
+	}
+
+	*data = (const char *) capture_frame->data;
+	return capture_frame->size;
+}
+
 /**
  * Start capturing data on the camera
  */
@@ -496,6 +2958,119 @@ void Camera_start_capture()
 {
 	DEBUG_PRINTLN("Starting image capture");
 	writeRegister(ARDUCHIP_FIFO, FIFO_START_MASK);
+	capture_trigger_us = Timer_now_us();
+}
+
+/**
+ * Choose between the learned capture done wait and polling every few microseconds
+ * @param enabled true to sleep through most of the expected capture time before polling
+ */
+void Camera_set_adaptive_wait(bool enabled) { wait_adaptive = enabled; }
+
+/**
+ * Get the cost of waiting for captures to complete
+ * @param[out] stats the frames waited for, SPI polls issued, wall time and CPU time spent
+ */
+void Camera_get_wait_stats(CAMERA_WAIT_STATS * stats)
+{
+	pthread_mutex_lock(&wait_stats_lock);
+	*stats = wait_stats;
+	pthread_mutex_unlock(&wait_stats_lock);
+}
+
+/**
+ * Clear the capture done wait statistics
+ */
+void Camera_reset_wait_stats()
+{
+	pthread_mutex_lock(&wait_stats_lock);
+	memset(&wait_stats, 0, sizeof(wait_stats));
+	pthread_mutex_unlock(&wait_stats_lock);
+}
+
+/**
+ * Wait for the capture started by Camera_start_capture() to complete. Each poll is an SPI
+ * transaction, so in adaptive mode the wait sleeps until shortly before the learned capture time
+ * for the current resolution and exposure, then polls finely.
+ */
+static void waitForCapture()
+{
+	unsigned long long wait_start_us = Timer_now_us();
+	unsigned long long cpu_start_us	 = threadCPUTimeUs();
+	unsigned long	   polls		 = 0;
+	unsigned int *	   expected_us	 = NULL;
+
+	if(wait_adaptive)
+	{
+		// Exposure only drifts slowly, so its range is refreshed while the sensor exposes
+		if(Timer_now_ms() - wait_exposure_read_ms > wait_exposure_refresh_ms)
+		{
+			unsigned char exp_high, exp_mid;
+			rdSensorReg16_8(sensor_aec_exposure_reg, &exp_high);
+			rdSensorReg16_8(sensor_aec_exposure_reg + 1, &exp_mid);
+
+			// Bucket by the power of two of the exposure in lines
+			unsigned int lines	 = ((exp_high & 0x0f) << 8) | exp_mid;
+			wait_exposure_bucket = 0;
+			while(lines > 0 && wait_exposure_bucket < WAIT_EXPOSURE_BUCKETS - 1)
+			{
+				lines >>= 1;
+				wait_exposure_bucket++;
+			}
+
+			wait_exposure_read_ms = Timer_now_ms();
+		}
+
+		expected_us = &wait_expected_us[current_resolution][wait_exposure_bucket];
+
+		unsigned long long wake_us = capture_trigger_us + *expected_us;
+		if(*expected_us > wait_wake_margin_us) { wake_us -= wait_wake_margin_us; }
+
+		unsigned long long now_us = Timer_now_us();
+		if(wake_us > now_us) { Timer_delay_us(wake_us - now_us); }
+	}
+
+	while(1)
+	{
+		polls++;
+		if(getBit(ARDUCHIP_TRIG, CAP_DONE_MASK)) { break; }
+
+		Timer_delay_us(wait_adaptive ? wait_fine_poll_us : wait_legacy_poll_us);
+	}
+
+	if(expected_us != NULL)
+	{
+		unsigned int measured_us = Timer_now_us() - capture_trigger_us;
+
+		// Done on the first poll means the sleep overshot, so only pull the estimate in
+		if(*expected_us == 0) { *expected_us = measured_us; }
+		else if(polls == 1) { *expected_us -= *expected_us / 16; }
+		else
+		{
+			*expected_us = (*expected_us * 7 + measured_us) / 8;
+		}
+	}
+
+	unsigned long long wait_us	   = Timer_now_us() - wait_start_us;
+	unsigned long long wait_cpu_us = threadCPUTimeUs() - cpu_start_us;
+
+	pthread_mutex_lock(&wait_stats_lock);
+	wait_stats.frames++;
+	wait_stats.polls += polls;
+	wait_stats.wait_us += wait_us;
+	wait_stats.wait_cpu_us += wait_cpu_us;
+	pthread_mutex_unlock(&wait_stats_lock);
+}
+
+/**
+ * Get the CPU time used by the calling thread
+ * @return the thread CPU time in microseconds
+ */
+static unsigned long long threadCPUTimeUs()
+{
+	struct timespec cpu_time;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_time);
+	return (unsigned long long) cpu_time.tv_sec * 1000000ULL + cpu_time.tv_nsec / 1000;
 }
 
 /**
@@ -529,6 +3104,20 @@ unsigned int readFIFOLength()
 		   0x7fffff;
 }
 
+/**
+ * Read a block from the camera's SPI FIFO queue in burst mode, which clocks out one byte per
+ * SPI byte instead of one byte per two byte register transaction. The whole block is one burst
+ * under a single chip select, since restarting a burst part way through a frame can clock a
+ * dummy byte into the JPEG data.
+ * @param[out] buffer the buffer to read into
+ * @param length the number of bytes to read
+ * @return 0 on success or -1 on failure
+ */
+int readFIFOBurst(unsigned char * buffer, unsigned int length)
+{
+	return SPI_burst_read(BURST_FIFO_READ, buffer, length);
+}
+
 /**
  * Set the camera's SPI FIFO queue to burst mode
  */
@@ -671,6 +3260,9 @@ void wrSensorReg16_8(int regID, int regDat)
 	Timer_delay_us(10);
 	I2C_write(camera_data, 3);
 	Timer_delay_us(10);
+
+	// 0xffff only marks the end of a register table, there is no such register to remember
+	if(regID != 0xffff) { shadowRecord(regID, regDat); }
 }
 
 /**
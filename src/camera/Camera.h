@@ -30,6 +30,10 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
+#include <stdbool.h>
+
+#include "FramePool.h"
+
 enum BUFFER_SIZE
 {
 	JPEG_BUFFER_SIZE = 2 * 1024 * 1024,
@@ -57,7 +61,10 @@ typedef enum
 	RES_1280x960,		// 1280x960
 	RES_1600x1200,		// 1600x1200
 	RES_2048x1536,		// 2048x1536
-	RES_2592x1944		// 2592x1944
+	RES_2592x1944,		// 2592x1944
+	RES_1280x720,		// 720p video preset
+	RES_1920x1080,		// 1080p video preset
+	RES_COUNT
 } RESOLUTION;
 
 typedef enum
@@ -233,19 +240,192 @@ enum FRAMERATE_DETECT
 	FRAMERATE_AUTO_DETECT
 };
 
-void Camera_init(int i2c_bus, unsigned int spi_bus, unsigned int spi_cs);
+typedef struct
+{
+	bool			   spi_online;
+	bool			   i2c_online;
+	bool			   restored;
+	unsigned int	   spi_attempts;
+	unsigned int	   i2c_attempts;
+	unsigned char	   sensor_vid;
+	unsigned char	   sensor_pid;
+	unsigned long long spi_ready_ms;
+	unsigned long long i2c_ready_ms;
+	unsigned long long total_ms;
+} CAMERA_INIT_STATUS;
+
+typedef struct
+{
+	unsigned long long awake_ms;
+	unsigned long long standby_ms;
+	unsigned long	   wake_count;
+	unsigned long long last_wake_us;
+	unsigned long long max_wake_us;
+	unsigned int	   est_average_power_mw;
+} CAMERA_POWER_STATS;
+
+typedef FRAME CAMERA_FRAME;
+
+#define CAMERA_MAX_INSTANCES 4
+
+typedef struct CAMERA CAMERA;
+
+typedef struct
+{
+	unsigned int	   cameras;
+	unsigned long	   frames;
+	unsigned long	   dropped;
+	unsigned long	   polls;
+	unsigned long long wait_us;
+	unsigned long long drain_us;
+	unsigned long	   camera_frames[CAMERA_MAX_INSTANCES];
+} CAMERA_MULTI_STATS;
+
+typedef struct
+{
+	unsigned long	   stills;
+	unsigned long	   misses;
+	unsigned long long last_latency_us;
+	unsigned long long max_latency_us;
+	unsigned long long average_latency_us;
+	unsigned long long last_age_us;
+	unsigned long long max_age_us;
+} CAMERA_ZSL_STATS;
+
+typedef struct
+{
+	unsigned long	   snapshots;
+	unsigned int	   registers_switched;
+	unsigned int	   registers_restored;
+	unsigned long long switch_us;
+	unsigned long long capture_us;
+	unsigned long long restore_us;
+	unsigned long long last_preview_gap_us;
+	unsigned long long max_preview_gap_us;
+} CAMERA_SNAPSHOT_STATS;
+
+typedef struct
+{
+	unsigned int  target_bytes;
+	unsigned int  last_bytes;
+	unsigned int  average_bytes;
+	unsigned int  qscale;
+	unsigned long frames;
+	unsigned long over_budget;
+	unsigned long adjustments;
+} CAMERA_RATE_STATS;
+
+typedef struct
+{
+	RESOLUTION		   resolution;
+	unsigned int	   target_fps;
+	unsigned long long frame_us;
+	unsigned long long readout_us;
+	unsigned long long spi_kb_per_sec;
+	unsigned int	   up_hold_windows;
+	unsigned long	   steps_up;
+	unsigned long	   steps_down;
+} CAMERA_AUTORES_STATS;
+
+typedef struct
+{
+	unsigned int x;
+	unsigned int y;
+	unsigned int width;
+	unsigned int height;
+} CAMERA_ROI;
+
+typedef struct
+{
+	unsigned long long capture_us;
+	unsigned long long drain_us;
+	unsigned int	   size;
+} CAMERA_CAPTURE_TIMING;
+
+typedef struct
+{
+	unsigned long	   frames;
+	unsigned long	   polls;
+	unsigned long long wait_us;
+	unsigned long long wait_cpu_us;
+} CAMERA_WAIT_STATS;
+
+int	 Camera_init(int i2c_bus, unsigned int spi_bus, unsigned int spi_cs);
+int	 Camera_init_minimal(int i2c_bus, unsigned int spi_bus, unsigned int spi_cs);
+void Camera_get_init_status(CAMERA_INIT_STATUS * status);
+void Camera_set_init_deadline_ms(unsigned int deadline_ms);
+void Camera_set_checkpoint_file(const char * filename);
+int	 Camera_save_checkpoint();
+void Camera_init_complete(RESOLUTION res, SPECIAL_EFFECTS effect);
+void Camera_set_settle_timeout_ms(unsigned int timeout_ms);
+unsigned int Camera_wait_for_exposure_settle(unsigned int timeout_ms);
 void Camera_shutdown();
 
 void Camera_set_image_format(IMAGE_TYPE img_format);
 void Camera_set_resolution(RESOLUTION res);
+unsigned int Camera_target_fps(RESOLUTION res);
+int	 Camera_set_roi(const CAMERA_ROI * region);
+int	 Camera_set_zoom(unsigned int zoom);
+bool Camera_get_roi(CAMERA_ROI * region, unsigned int * width, unsigned int * height);
+void Camera_set_quality(enum QUALITY quality);
+void Camera_set_frame_budget(unsigned int target_bytes);
+void Camera_get_rate_stats(CAMERA_RATE_STATS * stats);
+void Camera_set_auto_resolution(unsigned int target_fps, RESOLUTION min, RESOLUTION max);
+void Camera_get_auto_resolution_stats(CAMERA_AUTORES_STATS * stats);
 void Camera_set_color_saturation(COLOR_SATURATION sat);
 void Camera_set_brightness(BRIGHTNESS level);
 void Camera_set_special_effect(SPECIAL_EFFECTS effect);
 void Camera_set_sharpness_type(SHARPNESS_TYPE sharpness);
+void Camera_set_test_pattern(enum COLOR_TYPE pattern);
+void Camera_clear_test_pattern();
 
 void Camera_reset_firmware();
+void Camera_sleep();
+void Camera_wake();
+void Camera_get_power_stats(CAMERA_POWER_STATS * stats);
+
 void Camera_single_capture();
 void Camera_start_capture();
+void Camera_set_adaptive_wait(bool enabled);
+void Camera_get_wait_stats(CAMERA_WAIT_STATS * stats);
+void Camera_get_capture_timing(CAMERA_CAPTURE_TIMING * timing);
+void Camera_reset_wait_stats();
 void Camera_save_capture_to_file(const char * filename);
+int	 Camera_get_capture(const char ** data);
+
+unsigned int   Camera_frame_capacity(RESOLUTION res);
+void		   Camera_set_frame_pool_size(unsigned int count);
+CAMERA_FRAME * Camera_get_capture_frame();
+unsigned long  Camera_rejected_frames();
+
+int			   Camera_start_stream(unsigned int ring_size, unsigned int frames_per_trigger);
+CAMERA_FRAME * Camera_stream_next();
+unsigned long  Camera_stream_dropped();
+void		   Camera_stop_stream();
+
+int			   Camera_start_pipeline();
+CAMERA_FRAME * Camera_pipeline_next();
+void		   Camera_stop_pipeline();
+
+int Camera_burst_capture(unsigned int		   count,
+						 RESOLUTION			   res,
+						 CAMERA_FRAME **	   frames,
+						 unsigned long long * intervals_us);
+
+CAMERA *	   Camera_open(unsigned int spi_cs);
+void		   Camera_close(CAMERA * camera);
+int			   Camera_start_multi(CAMERA ** cameras, unsigned int count);
+CAMERA_FRAME * Camera_multi_next(unsigned int * index);
+void		   Camera_stop_multi();
+void		   Camera_get_multi_stats(CAMERA_MULTI_STATS * stats);
+
+CAMERA_FRAME * Camera_snapshot();
+void		   Camera_get_snapshot_stats(CAMERA_SNAPSHOT_STATS * stats);
+
+void		   Camera_set_zsl(bool enabled);
+int			   Camera_start_zsl();
+void		   Camera_stop_zsl();
+CAMERA_FRAME * Camera_zsl_capture(unsigned long long request_us);
+void		   Camera_get_zsl_stats(CAMERA_ZSL_STATS * stats);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,713 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2021 Lena Voytek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Clip
+ *
+ * This module records event clips as a stream of JPEG frames with a trailing timestamp index, so a
+ * player can seek straight to any moment, and recovers clips left unfinished by a power loss
+ *
+ * Layout: a 64 byte header, then one record per frame, a 32 byte record header followed by the
+ * JPEG and padded to 8 bytes, then the index of {timestamp, offset} pairs. The header only points
+ * at the index once the index is on disk, so a clip with no index offset was never closed.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "Debug.h"
+#include "Timer.h"
+#include "JPEG.h"
+#include "FrameWriter.h"
+
+#include "Clip.h"
+
+#define CLIP_MAGIC			"SDCLIP1"
+#define CLIP_VERSION		1
+#define CLIP_RECORD_MAGIC	0x4d52464a	  // "JFRM"
+#define CLIP_ALIGN			8
+#define CLIP_INDEX_INITIAL	1024
+#define CLIP_DROPPED_OFFSET 0
+
+typedef struct
+{
+	char			   magic[8];
+	unsigned int	   version;
+	unsigned int	   header_size;
+	unsigned long long created_realtime_us;
+	unsigned long long created_monotonic_us;
+	unsigned long long index_offset;
+	unsigned long long index_count;
+	unsigned long long data_end;
+	unsigned long long reserved;
+} CLIP_HEADER;
+
+typedef struct
+{
+	unsigned int	   magic;
+	unsigned int	   size;
+	unsigned long long timestamp_us;
+	unsigned long long sequence;
+	unsigned short	   width;
+	unsigned short	   height;
+	unsigned int	   reserved;
+} CLIP_RECORD;
+
+typedef struct
+{
+	unsigned long long timestamp_us;
+	unsigned long long offset;
+} CLIP_INDEX_ENTRY;
+
+struct CLIP
+{
+	pthread_mutex_t	   lock;
+	pthread_cond_t	   cond;
+	int				   file;
+	int				   fd;
+	unsigned long long end;
+	unsigned long long allocated;
+	unsigned long long preallocate_bytes;
+	unsigned int	   pending;
+	unsigned int	   appended;
+	unsigned int	   failed;
+	CLIP_INDEX_ENTRY * index;
+	unsigned int	   index_count;
+	unsigned int	   index_capacity;
+	CLIP_HEADER		   header;
+};
+
+struct CLIP_READER
+{
+	int				   fd;
+	CLIP_HEADER		   header;
+	CLIP_INDEX_ENTRY * index;
+	unsigned int	   index_count;
+	bool			   recovered;
+};
+
+static void				  recordWritten(FRAME * frame, int fd, int result, void * context);
+static void				  closeJob(void * context);
+static int				  writeAll(int fd, const void * data, size_t size, off_t offset);
+static int				  readAll(int fd, void * data, size_t size, off_t offset);
+static int				  loadIndex(CLIP_READER * reader);
+static int				  recoverIndex(CLIP_READER * reader);
+static int				  addIndexEntry(CLIP_INDEX_ENTRY ** index,
+										unsigned int *		 count,
+										unsigned int *		 capacity,
+										unsigned long long	 timestamp_us,
+										unsigned long long	 offset);
+static unsigned long long recordLength(unsigned int size);
+
+/**
+ * Start a new clip. Space is reserved from the writer once the first frame is out, so the card is
+ * not asked to allocate blocks for every write and the caller never waits on the reservation.
+ * @param filename the clip file, which must not already exist
+ * @param preallocate_bytes the space to reserve at a time, or 0 to let the file grow as written
+ * @return the clip, or NULL if the file could not be created with errno set to EEXIST if it exists
+ */
+CLIP * Clip_create(const char * filename, unsigned long long preallocate_bytes)
+{
+	CLIP *			clip = calloc(1, sizeof(CLIP));
+	struct timespec now;
+
+	if(clip == NULL) { return NULL; }
+
+	clip->file = FrameWriter_create(filename);
+	clip->fd   = FrameWriter_get_fd(clip->file);
+
+	if(clip->fd < 0)
+	{
+		int error = errno;
+
+		if(error != EEXIST) { ERROR_PRINTLN("Unable to create clip %50s", filename); }
+
+		free(clip);
+		errno = error;
+		return NULL;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	memcpy(clip->header.magic, CLIP_MAGIC, sizeof(clip->header.magic));
+	clip->header.version			  = CLIP_VERSION;
+	clip->header.header_size		  = sizeof(CLIP_HEADER);
+	clip->header.created_realtime_us  = now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+	clip->header.created_monotonic_us = Timer_now_us();
+
+	if(writeAll(clip->fd, &clip->header, sizeof(CLIP_HEADER), 0) < 0)
+	{
+		ERROR_PRINTLN("Unable to write clip header: return %d", errno);
+		FrameWriter_close(clip->file);
+		free(clip);
+		return NULL;
+	}
+
+	clip->end				= sizeof(CLIP_HEADER);
+	clip->preallocate_bytes = preallocate_bytes;
+
+	pthread_mutex_init(&clip->lock, NULL);
+	pthread_cond_init(&clip->cond, NULL);
+
+	return clip;
+}
+
+/**
+ * Queue a frame onto the end of a clip without waiting for it to reach storage
+ * @param clip the clip
+ * @param frame the JPEG frame, which the writer holds its own reference to
+ * @return 0 if the frame was queued or -1 if the writer queue is full
+ */
+int Clip_append(CLIP * clip, FRAME * frame)
+{
+	if(clip == NULL || frame == NULL) { return -1; }
+
+	CLIP_RECORD record = {
+		.magic		  = CLIP_RECORD_MAGIC,
+		.size		  = frame->size,
+		.timestamp_us = frame->timestamp_us,
+		.sequence	  = frame->sequence,
+		.width		  = frame->width,
+		.height		  = frame->height,
+	};
+
+	pthread_mutex_lock(&clip->lock);
+
+	unsigned long long offset = clip->end;
+
+	if(addIndexEntry(&clip->index,
+					 &clip->index_count,
+					 &clip->index_capacity,
+					 frame->timestamp_us,
+					 offset) < 0)
+	{
+		clip->failed++;
+		pthread_mutex_unlock(&clip->lock);
+		return -1;
+	}
+
+	clip->pending++;
+	clip->end = offset + recordLength(frame->size);
+	pthread_mutex_unlock(&clip->lock);
+
+	if(FrameWriter_write_record(clip->file,
+								&record,
+								sizeof(record),
+								frame,
+								offset,
+								recordWritten,
+								clip) < 0)
+	{
+		// Nothing was queued after this frame, so its slot is simply taken back
+		pthread_mutex_lock(&clip->lock);
+		clip->pending--;
+		clip->index_count--;
+		clip->end = offset;
+		clip->failed++;
+		pthread_mutex_unlock(&clip->lock);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Finish a clip. Once the frames are written the index is written after them and made durable,
+ * and only then is the header pointed at it, so the header update is the commit point.
+ * @param clip the clip, freed by this call
+ * @return 0 on success or -1 if the index could not be written
+ */
+int Clip_close(CLIP * clip)
+{
+	int result = 0;
+
+	if(clip == NULL) { return 0; }
+
+	pthread_mutex_lock(&clip->lock);
+
+	while(clip->pending > 0) { pthread_cond_wait(&clip->cond, &clip->lock); }
+
+	pthread_mutex_unlock(&clip->lock);
+
+	// Frames whose writes failed leave a hole that the index skips over
+	unsigned int count = 0;
+
+	for(unsigned int i = 0; i < clip->index_count; i++)
+	{
+		if(clip->index[i].offset != CLIP_DROPPED_OFFSET) { clip->index[count++] = clip->index[i]; }
+	}
+
+	size_t index_size = count * sizeof(CLIP_INDEX_ENTRY);
+
+	clip->header.index_offset = clip->end;
+	clip->header.index_count  = count;
+	clip->header.data_end	  = clip->end;
+
+	if(writeAll(clip->fd, clip->index, index_size, clip->end) < 0 || fdatasync(clip->fd) < 0 ||
+	   writeAll(clip->fd, &clip->header, sizeof(CLIP_HEADER), 0) < 0 || fdatasync(clip->fd) < 0)
+	{
+		ERROR_PRINTLN("Unable to finish clip: return %d", errno);
+		result = -1;
+	}
+	// Give back the reserved space past the index
+	else if(clip->allocated > clip->end + index_size)
+	{
+		if(ftruncate(clip->fd, clip->end + index_size) < 0) { result = -1; }
+	}
+
+	DEBUG_PRINTLN("Clip closed with %u frames, %u failed", count, clip->failed);
+
+	FrameWriter_close(clip->file);
+	pthread_mutex_destroy(&clip->lock);
+	pthread_cond_destroy(&clip->cond);
+	free(clip->index);
+	free(clip);
+
+	return result;
+}
+
+/**
+ * Finish a clip like Clip_close(), but on the frame writer's job thread so the caller does not
+ * wait for the queued frames or the index syncs. Runs in place if no job can be queued.
+ * @param clip the clip, freed once it is closed
+ */
+void Clip_close_async(CLIP * clip)
+{
+	if(clip == NULL) { return; }
+
+	if(FrameWriter_defer(closeJob, clip) < 0) { Clip_close(clip); }
+}
+
+/**
+ * Get the number of frames queued onto a clip
+ * @param clip the clip
+ * @return the number of frames appended
+ */
+unsigned int Clip_appended_frames(CLIP * clip)
+{
+	if(clip == NULL) { return 0; }
+
+	pthread_mutex_lock(&clip->lock);
+	unsigned int appended = clip->appended;
+	pthread_mutex_unlock(&clip->lock);
+
+	return appended;
+}
+
+/**
+ * Get the number of frames that could not be queued or failed to write
+ * @param clip the clip
+ * @return the number of frames missing from the clip
+ */
+unsigned int Clip_failed_frames(CLIP * clip)
+{
+	if(clip == NULL) { return 0; }
+
+	pthread_mutex_lock(&clip->lock);
+	unsigned int failed = clip->failed;
+	pthread_mutex_unlock(&clip->lock);
+
+	return failed;
+}
+
+/**
+ * Open a clip for playback. A clip that was never closed has its index rebuilt from the records,
+ * up to the first one that is incomplete or does not hold a valid JPEG.
+ * @param filename the clip file
+ * @return the reader, or NULL if the file is not a clip
+ */
+CLIP_READER * Clip_open(const char * filename)
+{
+	CLIP_READER * reader = calloc(1, sizeof(CLIP_READER));
+
+	if(reader == NULL) { return NULL; }
+
+	reader->fd = open(filename, O_RDONLY);
+
+	if(reader->fd < 0 || readAll(reader->fd, &reader->header, sizeof(CLIP_HEADER), 0) < 0 ||
+	   memcmp(reader->header.magic, CLIP_MAGIC, sizeof(reader->header.magic)) != 0 ||
+	   reader->header.version != CLIP_VERSION)
+	{
+		ERROR_PRINTLN("Not a clip file: %50s", filename);
+		Clip_close_reader(reader);
+		return NULL;
+	}
+
+	if(reader->header.index_offset != 0 && loadIndex(reader) == 0) { return reader; }
+
+	DEBUG_PRINTLN("Clip %50s was not closed, recovering", filename);
+	reader->recovered = true;
+
+	if(recoverIndex(reader) < 0)
+	{
+		Clip_close_reader(reader);
+		return NULL;
+	}
+
+	return reader;
+}
+
+/**
+ * Get the number of frames in a clip
+ * @param reader the clip reader
+ * @return the number of readable frames
+ */
+unsigned int Clip_frame_count(CLIP_READER * reader)
+{
+	return reader == NULL ? 0 : reader->index_count;
+}
+
+/**
+ * Check whether a clip's index had to be rebuilt because the clip was never closed
+ * @param reader the clip reader
+ * @return true if the clip was recovered
+ */
+bool Clip_was_recovered(CLIP_READER * reader)
+{
+	return reader != NULL && reader->recovered;
+}
+
+/**
+ * Find the frame showing a moment in the clip, using a binary search over the index
+ * @param reader the clip reader
+ * @param time_us the time since the first frame of the clip
+ * @return the index of the last frame at or before that time, or -1 if the clip is empty
+ */
+int Clip_find_frame(CLIP_READER * reader, unsigned long long time_us)
+{
+	if(reader == NULL || reader->index_count == 0) { return -1; }
+
+	unsigned long long target = reader->index[0].timestamp_us + time_us;
+	unsigned int	   low	  = 0;
+	unsigned int	   high	  = reader->index_count;
+
+	// The first entry later than the target, the frame before it is the one on screen
+	while(low < high)
+	{
+		unsigned int middle = low + (high - low) / 2;
+
+		if(reader->index[middle].timestamp_us <= target) { low = middle + 1; }
+		else
+		{
+			high = middle;
+		}
+	}
+
+	return low == 0 ? 0 : (int) low - 1;
+}
+
+/**
+ * Read one frame of a clip
+ * @param reader the clip reader
+ * @param index the frame number
+ * @param buffer where to copy the JPEG
+ * @param capacity the size of the buffer
+ * @param info filled with the frame size, dimensions, sequence and timestamp, may be NULL
+ * @return the JPEG size in bytes or -1 if the frame could not be read or does not fit
+ */
+int Clip_read_frame(CLIP_READER *	reader,
+					unsigned int	index,
+					unsigned char * buffer,
+					unsigned int	capacity,
+					FRAME *			info)
+{
+	CLIP_RECORD record;
+
+	if(reader == NULL || index >= reader->index_count) { return -1; }
+
+	off_t offset = reader->index[index].offset;
+
+	if(readAll(reader->fd, &record, sizeof(record), offset) < 0 ||
+	   record.magic != CLIP_RECORD_MAGIC || record.size > capacity ||
+	   readAll(reader->fd, buffer, record.size, offset + sizeof(record)) < 0)
+	{
+		return -1;
+	}
+
+	if(info != NULL)
+	{
+		info->size		   = record.size;
+		info->width		   = record.width;
+		info->height	   = record.height;
+		info->sequence	   = record.sequence;
+		info->timestamp_us = record.timestamp_us;
+	}
+
+	return record.size;
+}
+
+/**
+ * Close a clip reader
+ * @param reader the clip reader, freed by this call
+ */
+void Clip_close_reader(CLIP_READER * reader)
+{
+	if(reader == NULL) { return; }
+
+	if(reader->fd >= 0) { close(reader->fd); }
+
+	free(reader->index);
+	free(reader);
+}
+
+/**
+ * Writer callback for a frame record. Failed frames are dropped from the index, and more space is
+ * reserved here rather than on the capture thread once the clip nears the end of what it has.
+ * @param frame the frame that was written
+ * @param fd the clip file descriptor
+ * @param result the number of bytes written or a negative error
+ * @param context the clip
+ */
+static void recordWritten(FRAME * frame, int fd, int result, void * context)
+{
+	CLIP * clip = context;
+
+	pthread_mutex_lock(&clip->lock);
+
+	if(result < 0)
+	{
+		clip->failed++;
+
+		// Timestamps only increase, so the entry is found the same way a player seeks
+		for(unsigned int i = clip->index_count; i > 0; i--)
+		{
+			if(clip->index[i - 1].timestamp_us == frame->timestamp_us)
+			{
+				clip->index[i - 1].offset = CLIP_DROPPED_OFFSET;
+				break;
+			}
+		}
+	}
+	else
+	{
+		clip->appended++;
+	}
+
+	// Filesystems without fallocate() still record, they just allocate as they go
+	if(clip->preallocate_bytes > 0 && clip->end + clip->preallocate_bytes / 2 > clip->allocated)
+	{
+		if(fallocate(fd, FALLOC_FL_KEEP_SIZE, clip->allocated, clip->preallocate_bytes) == 0)
+		{
+			clip->allocated += clip->preallocate_bytes;
+		}
+		else
+		{
+			DEBUG_PRINTLN("Clip space not reserved: return %d", errno);
+			clip->preallocate_bytes = 0;
+		}
+	}
+
+	clip->pending--;
+	pthread_cond_broadcast(&clip->cond);
+	pthread_mutex_unlock(&clip->lock);
+}
+
+/**
+ * Writer job that closes a clip
+ * @param context the clip
+ */
+static void closeJob(void * context) { Clip_close(context); }
+
+/**
+ * Write a whole buffer at an offset
+ * @param fd the file descriptor
+ * @param data the bytes to write
+ * @param size the number of bytes
+ * @param offset the file offset
+ * @return 0 on success or -1 on error
+ */
+static int writeAll(int fd, const void * data, size_t size, off_t offset)
+{
+	const unsigned char * bytes = data;
+
+	while(size > 0)
+	{
+		ssize_t count = pwrite(fd, bytes, size, offset);
+
+		if(count < 0 && errno == EINTR) { continue; }
+		if(count <= 0) { return -1; }
+
+		bytes += count;
+		offset += count;
+		size -= count;
+	}
+
+	return 0;
+}
+
+/**
+ * Read a whole buffer from an offset
+ * @param fd the file descriptor
+ * @param data where to store the bytes
+ * @param size the number of bytes
+ * @param offset the file offset
+ * @return 0 on success or -1 on error or end of file
+ */
+static int readAll(int fd, void * data, size_t size, off_t offset)
+{
+	unsigned char * bytes = data;
+
+	while(size > 0)
+	{
+		ssize_t count = pread(fd, bytes, size, offset);
+
+		if(count < 0 && errno == EINTR) { continue; }
+		if(count <= 0) { return -1; }
+
+		bytes += count;
+		offset += count;
+		size -= count;
+	}
+
+	return 0;
+}
+
+/**
+ * Load the index of a closed clip
+ * @param reader the clip reader
+ * @return 0 on success or -1 if the index is missing or damaged
+ */
+static int loadIndex(CLIP_READER * reader)
+{
+	unsigned long long count = reader->header.index_count;
+
+	if(count == 0) { return 0; }
+	if(count > 0xffffffffULL / sizeof(CLIP_INDEX_ENTRY)) { return -1; }
+
+	reader->index = malloc(count * sizeof(CLIP_INDEX_ENTRY));
+
+	if(reader->index == NULL ||
+	   readAll(reader->fd, reader->index, count * sizeof(CLIP_INDEX_ENTRY),
+			   reader->header.index_offset) < 0)
+	{
+		free(reader->index);
+		reader->index = NULL;
+		return -1;
+	}
+
+	reader->index_count = count;
+	return 0;
+}
+
+/**
+ * Rebuild the index of a clip that was never closed by walking its records
+ * @param reader the clip reader
+ * @return 0 on success or -1 if out of memory
+ */
+static int recoverIndex(CLIP_READER * reader)
+{
+	unsigned long long offset	   = reader->header.header_size;
+	unsigned int	   capacity	   = 0;
+	unsigned char *	   buffer	   = NULL;
+	unsigned int	   buffer_size = 0;
+	CLIP_RECORD		   record;
+	JPEG_INFO		   info;
+
+	while(readAll(reader->fd, &record, sizeof(record), offset) == 0 &&
+		  record.magic == CLIP_RECORD_MAGIC)
+	{
+		if(record.size > buffer_size)
+		{
+			unsigned char * grown = realloc(buffer, record.size);
+
+			if(grown == NULL) { break; }
+
+			buffer		= grown;
+			buffer_size = record.size;
+		}
+
+		// Space reserved ahead of a crash reads back as zeros, so a record is only trusted when
+		// the whole JPEG made it to disk
+		if(readAll(reader->fd, buffer, record.size, offset + sizeof(record)) < 0 ||
+		   JPEG_validate(buffer, record.size, &info) != JPEG_VALID)
+		{
+			break;
+		}
+
+		if(addIndexEntry(&reader->index,
+						 &reader->index_count,
+						 &capacity,
+						 record.timestamp_us,
+						 offset) < 0)
+		{
+			free(buffer);
+			return -1;
+		}
+
+		offset += recordLength(record.size);
+	}
+
+	free(buffer);
+	DEBUG_PRINTLN("Recovered %u clip frames", reader->index_count);
+
+	return 0;
+}
+
+/**
+ * Add an entry to the end of an index, growing it as needed
+ * @param index the index array
+ * @param count the number of entries
+ * @param capacity the number of entries allocated
+ * @param timestamp_us the frame timestamp
+ * @param offset the frame record offset
+ * @return 0 on success or -1 if out of memory
+ */
+static int addIndexEntry(CLIP_INDEX_ENTRY ** index,
+						 unsigned int *		 count,
+						 unsigned int *		 capacity,
+						 unsigned long long	 timestamp_us,
+						 unsigned long long	 offset)
+{
+	if(*count == *capacity)
+	{
+		unsigned int	   grown_capacity = *capacity == 0 ? CLIP_INDEX_INITIAL : *capacity * 2;
+		CLIP_INDEX_ENTRY * grown		  = realloc(*index, grown_capacity * sizeof(**index));
+
+		if(grown == NULL) { return -1; }
+
+		*index	  = grown;
+		*capacity = grown_capacity;
+	}
+
+	(*index)[*count].timestamp_us = timestamp_us;
+	(*index)[*count].offset		  = offset;
+	(*count)++;
+
+	return 0;
+}
+
+/**
+ * Get the space a frame record takes in the clip
+ * @param size the JPEG size
+ * @return the record length including its header and padding
+ */
+static unsigned long long recordLength(unsigned int size)
+{
+	return (sizeof(CLIP_RECORD) + size + CLIP_ALIGN - 1) & ~(unsigned long long) (CLIP_ALIGN - 1);
+}
@@ -0,0 +1,59 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2021 Lena Voytek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Clip
+ *
+ * This module records event clips as a stream of JPEG frames with a trailing timestamp index, so a
+ * player can seek straight to any moment, and recovers clips left unfinished by a power loss
+ */
+
+#ifndef CLIP_H
+#define CLIP_H
+
+#include <stdbool.h>
+
+#include "FramePool.h"
+
+typedef struct CLIP		   CLIP;
+typedef struct CLIP_READER CLIP_READER;
+
+CLIP * Clip_create(const char * filename, unsigned long long preallocate_bytes);
+int	   Clip_append(CLIP * clip, FRAME * frame);
+int	   Clip_close(CLIP * clip);
+void   Clip_close_async(CLIP * clip);
+
+unsigned int Clip_appended_frames(CLIP * clip);
+unsigned int Clip_failed_frames(CLIP * clip);
+
+CLIP_READER * Clip_open(const char * filename);
+unsigned int  Clip_frame_count(CLIP_READER * reader);
+bool		  Clip_was_recovered(CLIP_READER * reader);
+int			  Clip_find_frame(CLIP_READER * reader, unsigned long long time_us);
+int			  Clip_read_frame(CLIP_READER * reader,
+							  unsigned int	  index,
+							  unsigned char * buffer,
+							  unsigned int	  capacity,
+							  FRAME *		  info);
+void		  Clip_close_reader(CLIP_READER * reader);
+
+#endif
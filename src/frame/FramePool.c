@@ -0,0 +1,236 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2021 Lena Voytek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Frame Pool
+ *
+ * This module manages preallocated, reference counted frame buffers so captured images can be
+ * shared between the capture, streaming and storage paths without copying
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "Debug.h"
+
+#include "FramePool.h"
+
+struct FRAME_POOL
+{
+	pthread_mutex_t lock;
+	FRAME *			frames;
+	FRAME **		free_frames;
+	unsigned char * storage;
+	unsigned int	count;
+	unsigned int	capacity;
+	unsigned int	free_count;
+	unsigned long	id;
+	bool			destroyed;
+};
+
+// Pools are numbered so a pool is never mistaken for an earlier one at the same address
+static unsigned long next_pool_id = 1;
+
+static void freePool(FRAME_POOL * pool);
+
+/**
+ * Allocate a pool of frames up front, so capturing never allocates
+ * @param count the number of frames in the pool
+ * @param capacity the size in bytes of each frame buffer, or 0 for frames whose owner points them
+ * at its own memory
+ * @return the new pool, or NULL on failure
+ */
+FRAME_POOL * FramePool_create(unsigned int count, unsigned int capacity)
+{
+	FRAME_POOL * pool = calloc(1, sizeof(FRAME_POOL));
+	if(pool == NULL) { return NULL; }
+
+	pool->frames	  = calloc(count, sizeof(FRAME));
+	pool->free_frames = calloc(count, sizeof(FRAME *));
+	pool->storage	  = capacity > 0 ? malloc((size_t) count * capacity) : NULL;
+
+	if(count == 0 || pool->frames == NULL || pool->free_frames == NULL ||
+	   (capacity > 0 && pool->storage == NULL))
+	{
+		ERROR_PRINTLN("Unable to allocate a pool of %u frames of %u bytes", count, capacity);
+		freePool(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->count		 = count;
+	pool->capacity	 = capacity;
+	pool->free_count = count;
+	pool->id		 = __atomic_fetch_add(&next_pool_id, 1, __ATOMIC_RELAXED);
+
+	for(unsigned int i = 0; i < count; i++)
+	{
+		pool->frames[i].data	 = pool->storage + (size_t) i * capacity;
+		pool->frames[i].capacity = capacity;
+		pool->frames[i].pool	 = pool;
+		pool->free_frames[i]	 = &pool->frames[i];
+	}
+
+	DEBUG_PRINTLN("Allocated a pool of %u frames of %u bytes", count, capacity);
+	return pool;
+}
+
+/**
+ * Destroy a pool. Frames still referenced stay valid and the memory is freed once the last of
+ * them is released.
+ * @param pool the pool to destroy, may be NULL
+ */
+void FramePool_destroy(FRAME_POOL * pool)
+{
+	if(pool == NULL) { return; }
+
+	pthread_mutex_lock(&pool->lock);
+	pool->destroyed = true;
+	bool idle		= pool->free_count == pool->count;
+	pthread_mutex_unlock(&pool->lock);
+
+	if(idle) { freePool(pool); }
+}
+
+/**
+ * Take a free frame from the pool with a single reference held by the caller
+ * @param pool the pool to take from
+ * @return the frame, or NULL if every frame is in use
+ */
+FRAME * FramePool_acquire(FRAME_POOL * pool)
+{
+	FRAME * frame = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+
+	if(pool->free_count > 0 && !pool->destroyed)
+	{
+		frame			  = pool->free_frames[--pool->free_count];
+		frame->references = 1;
+		frame->size		  = 0;
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+	return frame;
+}
+
+/**
+ * Add a reference to a frame so another user can hold on to it
+ * @param frame the frame to share
+ * @return the same frame
+ */
+FRAME * FramePool_retain(FRAME * frame)
+{
+	pthread_mutex_lock(&frame->pool->lock);
+	frame->references++;
+	pthread_mutex_unlock(&frame->pool->lock);
+
+	return frame;
+}
+
+/**
+ * Drop a reference to a frame, returning it to its pool when nobody holds it any more
+ * @param frame the frame to release, may be NULL
+ */
+void FramePool_release(FRAME * frame)
+{
+	if(frame == NULL) { return; }
+
+	FRAME_POOL * pool = frame->pool;
+	bool		 idle = false;
+
+	pthread_mutex_lock(&pool->lock);
+
+	if(frame->references == 0) { ERROR_PRINTLN("Frame released more times than it was held"); }
+	else if(--frame->references == 0)
+	{
+		pool->free_frames[pool->free_count++] = frame;
+		idle = pool->destroyed && pool->free_count == pool->count;
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	if(idle) { freePool(pool); }
+}
+
+/**
+ * Get the number of frames in a pool
+ * @param pool the pool
+ * @return the frame count
+ */
+unsigned int FramePool_count(FRAME_POOL * pool) { return pool->count; }
+
+/**
+ * Get the size of each frame buffer in a pool
+ * @param pool the pool
+ * @return the frame capacity in bytes
+ */
+unsigned int FramePool_capacity(FRAME_POOL * pool) { return pool->capacity; }
+
+/**
+ * Get the number of frames that can currently be acquired
+ * @param pool the pool
+ * @return the free frame count
+ */
+unsigned int FramePool_available(FRAME_POOL * pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	unsigned int available = pool->free_count;
+	pthread_mutex_unlock(&pool->lock);
+
+	return available;
+}
+
+/**
+ * Get the number that identifies a pool for as long as the process runs
+ * @param pool the pool
+ * @return the pool id, never reused by a later pool
+ */
+unsigned long FramePool_id(FRAME_POOL * pool) { return pool->id; }
+
+/**
+ * Get the single block of memory holding every frame buffer in a pool, for registering it with
+ * the kernel once instead of per frame
+ * @param pool the pool
+ * @param[out] length the block size in bytes
+ * @return the start of the block
+ */
+unsigned char * FramePool_storage(FRAME_POOL * pool, unsigned long * length)
+{
+	*length = (unsigned long) pool->count * pool->capacity;
+	return pool->storage;
+}
+
+/**
+ * Free a pool and every frame buffer in it
+ * @param pool the pool to free
+ */
+static void freePool(FRAME_POOL * pool)
+{
+	if(pool->count > 0) { pthread_mutex_destroy(&pool->lock); }
+
+	free(pool->storage);
+	free(pool->free_frames);
+	free(pool->frames);
+	free(pool);
+}
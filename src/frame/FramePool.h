@@ -0,0 +1,62 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2021 Lena Voytek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Frame Pool
+ *
+ * This module manages preallocated, reference counted frame buffers so captured images can be
+ * shared between the capture, streaming and storage paths without copying
+ */
+
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+typedef struct FRAME_POOL FRAME_POOL;
+
+typedef struct
+{
+	unsigned char *	   data;
+	unsigned int	   size;
+	unsigned int	   capacity;
+	unsigned int	   width;
+	unsigned int	   height;
+	unsigned long	   sequence;
+	unsigned long long timestamp_us;
+	unsigned int	   references;
+	FRAME_POOL *	   pool;
+} FRAME;
+
+FRAME_POOL * FramePool_create(unsigned int count, unsigned int capacity);
+void		 FramePool_destroy(FRAME_POOL * pool);
+
+FRAME *		 FramePool_acquire(FRAME_POOL * pool);
+FRAME *		 FramePool_retain(FRAME * frame);
+void		 FramePool_release(FRAME * frame);
+
+unsigned int FramePool_count(FRAME_POOL * pool);
+unsigned int FramePool_capacity(FRAME_POOL * pool);
+unsigned int FramePool_available(FRAME_POOL * pool);
+
+unsigned long	FramePool_id(FRAME_POOL * pool);
+unsigned char * FramePool_storage(FRAME_POOL * pool, unsigned long * length);
+
+#endif
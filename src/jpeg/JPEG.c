@@ -0,0 +1,228 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2021 Lena Voytek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * JPEG
+ *
+ * This module validates JPEG frames read from the camera, finding the image inside any padding
+ * around it and reading its dimensions from the frame header
+ */
+
+#include <stdbool.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define JPEG_VECTOR_SCAN true
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define JPEG_VECTOR_SCAN true
+#else
+#define JPEG_VECTOR_SCAN false
+#endif
+
+#include "JPEG.h"
+
+// Marker codes following a 0xFF byte
+#define JPEG_MARKER_SOI	 0xD8
+#define JPEG_MARKER_EOI	 0xD9
+#define JPEG_MARKER_SOS	 0xDA
+#define JPEG_MARKER_TEM	 0x01
+#define JPEG_MARKER_RST0 0xD0
+#define JPEG_MARKER_RST7 0xD7
+#define JPEG_MARKER_SOF0 0xC0
+#define JPEG_MARKER_SOF2 0xC2
+
+static bool vector_scan = JPEG_VECTOR_SCAN;
+
+static const char * status_names[] = {"valid", "no start of image", "bad marker",
+									  "no frame header", "truncated"};
+
+static int findMarkerScalar(const unsigned char * data, unsigned int length, unsigned char marker);
+static int findMarkerVector(const unsigned char * data, unsigned int length, unsigned char marker);
+
+/**
+ * Check that a buffer holds a complete baseline or progressive JPEG. The segments between the
+ * start of image and the start of scan are walked one by one, then the entropy coded data is
+ * scanned for the end of image marker, which it cannot contain since 0xFF bytes in it are
+ * stuffed.
+ * @param data the buffer to check, which may have padding before and after the image
+ * @param length the buffer length in bytes
+ * @param[out] info the image bounds within the buffer and its dimensions
+ * @return JPEG_VALID, or the reason the image was rejected
+ */
+JPEG_STATUS JPEG_validate(const unsigned char * data, unsigned int length, JPEG_INFO * info)
+{
+	info->width	 = 0;
+	info->height = 0;
+
+	int start = JPEG_find_marker(data, length, JPEG_MARKER_SOI);
+	if(start < 0) { return JPEG_NO_START; }
+
+	info->start		 = start;
+	unsigned int pos = start + 2;
+
+	while(1)
+	{
+		if(pos + 1 >= length) { return JPEG_TRUNCATED; }
+		if(data[pos] != 0xFF) { return JPEG_BAD_MARKER; }
+
+		// Any number of 0xFF fill bytes may come before a marker
+		while(pos + 1 < length && data[pos + 1] == 0xFF) { pos++; }
+		if(pos + 1 >= length) { return JPEG_TRUNCATED; }
+
+		unsigned char marker = data[pos + 1];
+		pos += 2;
+
+		if(marker == JPEG_MARKER_TEM || (marker >= JPEG_MARKER_RST0 && marker <= JPEG_MARKER_RST7))
+		{
+			continue;
+		}
+
+		if(marker == JPEG_MARKER_SOI || marker == JPEG_MARKER_EOI) { return JPEG_BAD_MARKER; }
+		if(pos + 2 > length) { return JPEG_TRUNCATED; }
+
+		unsigned int segment_length = (data[pos] << 8) | data[pos + 1];
+
+		if(segment_length < 2) { return JPEG_BAD_MARKER; }
+		if(pos + segment_length > length) { return JPEG_TRUNCATED; }
+
+		if(marker >= JPEG_MARKER_SOF0 && marker <= JPEG_MARKER_SOF2)
+		{
+			if(segment_length < 7) { return JPEG_BAD_MARKER; }
+
+			info->height = (data[pos + 3] << 8) | data[pos + 4];
+			info->width	 = (data[pos + 5] << 8) | data[pos + 6];
+		}
+
+		pos += segment_length;
+
+		if(marker == JPEG_MARKER_SOS) { break; }
+	}
+
+	if(info->width == 0 || info->height == 0) { return JPEG_NO_FRAME_HEADER; }
+
+	int end = JPEG_find_marker(data + pos, length - pos, JPEG_MARKER_EOI);
+	if(end < 0) { return JPEG_TRUNCATED; }
+
+	info->end = pos + end + 2;
+	return JPEG_VALID;
+}
+
+/**
+ * Find the first occurrence of a marker, 0xFF followed by the marker code
+ * @param data the buffer to search
+ * @param length the buffer length in bytes
+ * @param marker the marker code
+ * @return the offset of the 0xFF byte, or -1 if the marker was not found
+ */
+int JPEG_find_marker(const unsigned char * data, unsigned int length, unsigned char marker)
+{
+	return vector_scan ? findMarkerVector(data, length, marker) :
+						 findMarkerScalar(data, length, marker);
+}
+
+/**
+ * Get a readable reason for a validation result
+ * @param status the validation result
+ * @return the status name
+ */
+const char * JPEG_status_name(JPEG_STATUS status)
+{
+	if(status > JPEG_TRUNCATED) { return "unknown"; }
+	return status_names[status];
+}
+
+/**
+ * Check whether this build can search for markers with SSE2 or NEON
+ * @return true if the vector search is available
+ */
+bool JPEG_vector_scan_available() { return JPEG_VECTOR_SCAN; }
+
+/**
+ * Choose between the vector and scalar marker search, mainly to compare the two
+ * @param enabled true to use the vector search when it is available
+ */
+void JPEG_set_vector_scan(bool enabled) { vector_scan = enabled && JPEG_VECTOR_SCAN; }
+
+/**
+ * Find a marker one byte at a time
+ * @param data the buffer to search
+ * @param length the buffer length in bytes
+ * @param marker the marker code
+ * @return the offset of the 0xFF byte, or -1 if the marker was not found
+ */
+static int findMarkerScalar(const unsigned char * data, unsigned int length, unsigned char marker)
+{
+	for(unsigned int i = 0; i + 1 < length; i++)
+	{
+		if(data[i] == 0xFF && data[i + 1] == marker) { return i; }
+	}
+
+	return -1;
+}
+
+/**
+ * Find a marker 16 bytes at a time by comparing each block and the block one byte later against
+ * 0xFF and the marker code, finishing the tail with the scalar search
+ * @param data the buffer to search
+ * @param length the buffer length in bytes
+ * @param marker the marker code
+ * @return the offset of the 0xFF byte, or -1 if the marker was not found
+ */
+static int findMarkerVector(const unsigned char * data, unsigned int length, unsigned char marker)
+{
+	unsigned int i = 0;
+
+#if defined(__SSE2__)
+	const __m128i prefix = _mm_set1_epi8((char) 0xFF);
+	const __m128i code	 = _mm_set1_epi8((char) marker);
+
+	for(; i + 17 <= length; i += 16)
+	{
+		__m128i first  = _mm_loadu_si128((const __m128i *) (data + i));
+		__m128i second = _mm_loadu_si128((const __m128i *) (data + i + 1));
+		int		match  = _mm_movemask_epi8(
+			   _mm_and_si128(_mm_cmpeq_epi8(first, prefix), _mm_cmpeq_epi8(second, code)));
+
+		if(match != 0) { return i + __builtin_ctz(match); }
+	}
+#elif defined(__ARM_NEON)
+	const uint8x16_t prefix = vdupq_n_u8(0xFF);
+	const uint8x16_t code	= vdupq_n_u8(marker);
+
+	for(; i + 17 <= length; i += 16)
+	{
+		uint8x16_t match = vandq_u8(vceqq_u8(vld1q_u8(data + i), prefix),
+									vceqq_u8(vld1q_u8(data + i + 1), code));
+		uint64x2_t lanes = vreinterpretq_u64_u8(match);
+		uint64_t   low	 = vgetq_lane_u64(lanes, 0);
+		uint64_t   high	 = vgetq_lane_u64(lanes, 1);
+
+		// Matching bytes are all ones, so the lowest set bit gives the byte offset
+		if(low != 0) { return i + __builtin_ctzll(low) / 8; }
+		if(high != 0) { return i + 8 + __builtin_ctzll(high) / 8; }
+	}
+#endif
+
+	int offset = findMarkerScalar(data + i, length - i, marker);
+	return offset < 0 ? -1 : (int) i + offset;
+}
@@ -0,0 +1,59 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2021 Lena Voytek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * JPEG
+ *
+ * This module validates JPEG frames read from the camera, finding the image inside any padding
+ * around it and reading its dimensions from the frame header
+ */
+
+#ifndef JPEG_H
+#define JPEG_H
+
+#include <stdbool.h>
+
+typedef enum
+{
+	JPEG_VALID = 0,
+	JPEG_NO_START,
+	JPEG_BAD_MARKER,
+	JPEG_NO_FRAME_HEADER,
+	JPEG_TRUNCATED
+} JPEG_STATUS;
+
+typedef struct
+{
+	unsigned int start;
+	unsigned int end;
+	unsigned int width;
+	unsigned int height;
+} JPEG_INFO;
+
+JPEG_STATUS	 JPEG_validate(const unsigned char * data, unsigned int length, JPEG_INFO * info);
+int			 JPEG_find_marker(const unsigned char * data, unsigned int length, unsigned char marker);
+const char * JPEG_status_name(JPEG_STATUS status);
+
+bool JPEG_vector_scan_available();
+void JPEG_set_vector_scan(bool enabled);
+
+#endif
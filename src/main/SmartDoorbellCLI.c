@@ -27,6 +27,8 @@
  * Doorbell application
  */
 
+#define _GNU_SOURCE
+
 #include <pthread.h>
 #include <signal.h>
 #include <unistd.h>
@@ -35,31 +37,184 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 
 #include <Camera.h>
+#include <JPEG.h>
+#include <FrameWriter.h>
+#include <FramePublisher.h>
+#include <Clip.h>
+#include <PreRoll.h>
 #include <Button.h>
+#include <Timer.h>
 
 #include <Debug.h>
 
 #define SMART_DOORBELL_VERSION "1.00"
 
 static const int doorbell_button_gpio	  = 86;
+static const int camera_i2c_bus			  = 2;
+static const int camera_spi_bus			  = 1;
+static const int camera_spi_cs			  = 0;
 static const int doorbell_video_runtime_s = 30;
 
 static const unsigned int button_press_pause_min_ms = 100;
 static const unsigned int button_press_pause_max_ms = 1000;
 
+static const char * capture_filename		  = "image.jpg";
+static const char * control_socket_path	  = "/tmp/smart-doorbell.sock";
+static const char * sensor_checkpoint_path = "/var/tmp/smart-doorbell-sensor.ckpt";
+static const char * latest_frame_shm_name  = "/smart-doorbell-latest";
+static const char * clip_directory		  = "clips";
+static const char * still_directory		  = "stills";
+
+#define MAX_EPOLL_EVENTS	8
+#define BENCHMARK_FRAMES	30
+#define JPEG_BENCHMARK_US	200000
+#define JPEG_FIFO_PADDING	4096
+#define CONTROL_COMMAND_MAX 64
+#define FRAME_WRITE_QUEUE	8
+#define CLIP_PREALLOCATE	(8 * 1024 * 1024)
+#define CLIP_NAME_MAX		128
+#define CLIP_NAME_ATTEMPTS	100
+#define PREROLL_MAX_FRAMES	256
+#define PREROLL_RETRY_MS	100
+#define BURST_MAX_FRAMES	64
+#define STILL_MAX_WRITES	2
+
 static bool runonce								= false;
 static bool add_random_delay_after_button_press = false;
+static bool camera_cold_start_per_press			= false;
+static bool run_pipeline_benchmark_only			= false;
+static int	jpeg_benchmark_first_file			= 0;
+static unsigned int preroll_budget_kb			= 0;
+static bool zero_shutter_lag					= false;
+static unsigned int burst_benchmark_frames		= 0;
+static bool full_resolution_snapshot			= false;
+
+static bool run_video_benchmark_only			= false;
+static bool porch_roi_enabled					= false;
+static CAMERA_ROI porch_roi;
+static unsigned int porch_zoom					= 1;
+static unsigned int frame_budget_kb				= 0;
+static unsigned int auto_resolution_fps			= 0;
+static unsigned int capture_benchmark_frames	= 0;
+static enum COLOR_TYPE benchmark_pattern		= COLOR_BAR;
+
+static const char * pattern_names[] = {"bar", "square", "bw", "dli"};
+
+static unsigned int multi_benchmark_frames		= 0;
+static unsigned int multi_camera_count			= 0;
+static unsigned int multi_camera_cs[CAMERA_MAX_INSTANCES];
+
+static const char * resolution_names[] = {"320x240",
+										  "640x480",
+										  "1024x768",
+										  "1280x960",
+										  "1600x1200",
+										  "2048x1536",
+										  "2592x1944",
+										  "1280x720",
+										  "1920x1080"};
 
 bool debug = false;
 
-static void * camera_thread_handler(void * arg);
-static void * doorbell_thread_handler(void * arg);
+typedef enum
+{
+	DOORBELL_IDLE = 0,
+	DOORBELL_PAUSED,
+	DOORBELL_RECORDING
+} DOORBELL_STATE;
+
+// A still waiting for the writer's job thread to create its file
+typedef struct
+{
+	FRAME *		 still;
+	const char * kind;
+	char		 filename[CLIP_NAME_MAX];
+} STILL_JOB;
+
+// Event loop state, only touched from the main thread
+static DOORBELL_STATE doorbell_state		= DOORBELL_IDLE;
+static int			  button_fd			= -1;
+static int			  session_timer_fd	= -1;
+static int			  signal_fd			= -1;
+static int			  control_fd		= -1;
+static bool			  event_loop_running = true;
+
+// Worker state, shared with the event loop under worker_lock
+static pthread_mutex_t worker_lock		= PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  capture_cond		= PTHREAD_COND_INITIALIZER;
+static bool			   workers_running	= true;
+static bool			   capture_enabled	= false;
+
+static unsigned long frames_captured = 0;
+static unsigned long frames_dropped	 = 0;
+
+// Frames from between visitors, only stored to by the capture worker
+static PREROLL * preroll = NULL;
+
+static unsigned long stills_saved = 0;
+
+// Each still holds one of the writer's FRAME_WRITER_MAX_FILES files until it is on disk, so only a
+// few may be in flight beside the clip and the latest frame file
+static pthread_mutex_t still_lock	  = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int	   stills_writing = 0;
+
+// Press to first JPEG latency, to compare the warm standby and cold start camera paths
+static unsigned long	  capture_session			 = 0;
+static unsigned long long press_time_us				 = 0;
+static unsigned long long first_frame_latency_us	 = 0;
+static unsigned long long first_frame_latency_min_us = 0;
+static unsigned long long first_frame_latency_max_us = 0;
+static unsigned long long first_frame_latency_sum_us = 0;
+static unsigned long	  first_frame_latency_count	 = 0;
+
+static void * capture_thread_handler(void * arg);
+
+static void run_event_loop(int epoll_fd);
+static void handle_button_press();
+static void handle_session_timer();
+static void handle_signal();
+static void handle_control_connection(int epoll_fd);
+static void handle_control_client(int epoll_fd, int client_fd);
+
+static void record_first_frame_latency(unsigned long long frame_time_us);
+static void wait_for_session_end(unsigned long session);
+static void save_frame(const char * data, int size);
+static int	run_pipeline_benchmark();
+static int	run_jpeg_benchmark(char * files[], int count);
+static int	run_burst_benchmark(unsigned int count);
+static int	run_video_benchmark();
+static int	run_capture_benchmark(unsigned int count);
+static int	compare_us(const void * a, const void * b);
+static int	run_multi_benchmark(unsigned int count);
+static void start_recording();
+static void stop_recording();
+static void arm_session_timer(unsigned int time_ms);
+static int	open_control_socket();
+static int	add_epoll_fd(int epoll_fd, int fd, unsigned int events);
+
+static CLIP *			  open_event_clip();
+static void				  capture_preroll_frame(bool * camera_asleep, bool * pipeline_active);
+static int				  save_still(unsigned long long request_us);
+static int				  write_still(FRAME * still, const char * kind);
+static void				  open_still_file(void * context);
+static bool				  acquire_still_slot();
+static void				  release_still_slot();
+static void				  still_written(FRAME * frame, int fd, int result, void * context);
+static unsigned long long run_serial_frames(CAMERA_WAIT_STATS * wait);
 
 int main(int argc, char * argv[])
 {
-	pthread_t doorbell_thread;
+	pthread_t capture_thread;
 
 	// Random seed based on current time
 	time_t t;
@@ -82,6 +237,114 @@ int main(int argc, char * argv[])
 		{
 			add_random_delay_after_button_press = true;
 		}
+		// Re-initialize the camera on every press instead of keeping it in warm standby
+		else if(strncmp(argv[i], "-c", 2) == 0 || strncmp(argv[i], "--cold", 6) == 0)
+		{
+			camera_cold_start_per_press = true;
+		}
+		// Compare serial and double buffered capture throughput at every resolution
+		else if(strncmp(argv[i], "--bench-pipeline", 16) == 0)
+		{
+			run_pipeline_benchmark_only = true;
+		}
+		// Measure the sustained burst rate at every resolution
+		else if(strncmp(argv[i], "--bench-burst", 13) == 0 && i + 1 < argc)
+		{
+			burst_benchmark_frames = strtoul(argv[++i], NULL, 10);
+		}
+		// Measure the streaming rate of every still size and video preset
+		else if(strncmp(argv[i], "--bench-video", 13) == 0)
+		{
+			run_video_benchmark_only = true;
+		}
+		// Time serial captures of a sensor test pattern at every resolution
+		else if(strcmp(argv[i], "--bench") == 0 && i + 1 < argc)
+		{
+			capture_benchmark_frames = strtoul(argv[++i], NULL, 10);
+		}
+		// Measure how the frame rate scales with more cameras on the SPI bus
+		else if(strncmp(argv[i], "--bench-multi", 13) == 0 && i + 1 < argc)
+		{
+			multi_benchmark_frames = strtoul(argv[++i], NULL, 10);
+		}
+		// Chip selects of the cameras sharing the SPI bus, the first is the doorbell camera
+		else if(strncmp(argv[i], "--cameras", 9) == 0 && i + 1 < argc)
+		{
+			char * next		   = argv[++i];
+			multi_camera_count = 0;
+
+			while(multi_camera_count < CAMERA_MAX_INSTANCES && *next != '\0')
+			{
+				multi_camera_cs[multi_camera_count++] = strtoul(next, &next, 10);
+				if(*next == ',') { next++; }
+				else
+				{
+					break;
+				}
+			}
+		}
+		// Choose the test pattern the capture benchmark runs on
+		else if(strncmp(argv[i], "--pattern", 9) == 0 && i + 1 < argc)
+		{
+			i++;
+
+			for(int pattern = COLOR_BAR; pattern <= COLOR_DLI; pattern++)
+			{
+				if(strcmp(argv[i], pattern_names[pattern]) == 0) { benchmark_pattern = pattern; }
+			}
+		}
+		// Measure the JPEG validator scan rate on the sample files that follow
+		else if(strncmp(argv[i], "--bench-jpeg", 12) == 0)
+		{
+			jpeg_benchmark_first_file = i + 1;
+			break;
+		}
+		// Keep capturing between visitors so each clip starts before the press
+		else if(strncmp(argv[i], "--preroll", 9) == 0 && i + 1 < argc)
+		{
+			preroll_budget_kb = strtoul(argv[++i], NULL, 10);
+		}
+		// Keep the camera capturing between visitors so a press gets a still straight away
+		else if(strncmp(argv[i], "--zsl", 5) == 0)
+		{
+			zero_shutter_lag = true;
+		}
+		// Take one full resolution still per visitor while the preview keeps streaming
+		else if(strncmp(argv[i], "--snapshot", 10) == 0)
+		{
+			full_resolution_snapshot = true;
+		}
+		// Only capture the porch, given as X,Y,WIDTHxHEIGHT in 2592x1944 sensor coordinates
+		else if(strncmp(argv[i], "--roi", 5) == 0 && i + 1 < argc)
+		{
+			porch_roi_enabled = true;
+
+			if(sscanf(argv[++i],
+					  "%u,%u,%ux%u",
+					  &porch_roi.x,
+					  &porch_roi.y,
+					  &porch_roi.width,
+					  &porch_roi.height) != 4)
+			{
+				ERROR_PRINTLN("Region %50s is not X,Y,WIDTHxHEIGHT", argv[i]);
+				return 1;
+			}
+		}
+		// Hold every frame near a size budget by adjusting the JPEG quality
+		else if(strncmp(argv[i], "--frame-budget", 14) == 0 && i + 1 < argc)
+		{
+			frame_budget_kb = strtoul(argv[++i], NULL, 10);
+		}
+		// Pick the largest resolution that holds a frame rate
+		else if(strncmp(argv[i], "--auto-res", 10) == 0 && i + 1 < argc)
+		{
+			auto_resolution_fps = strtoul(argv[++i], NULL, 10);
+		}
+		// Zoom into the centre of the sensor
+		else if(strncmp(argv[i], "--zoom", 6) == 0 && i + 1 < argc)
+		{
+			porch_zoom = strtoul(argv[++i], NULL, 10);
+		}
 		// Show help menu
 		else if(strncmp(argv[i], "-h", 2) == 0 || strncmp(argv[i], "--help", 6) == 0)
 		{
@@ -94,8 +357,34 @@ int main(int argc, char * argv[])
 				"the video feed ends\n"
 				"  -p, --addpause\tAdd a random pause from 100ms to 1s to simulate an attack on "
 				"the application after a button press\n"
+				"  -c, --cold\t\tInitialize the camera on every press instead of keeping it "
+				"in standby\n"
+				"  --bench-pipeline\tMeasure serial and double buffered capture rates at each "
+				"resolution and exit\n"
+				"  --bench-burst N\tCapture a burst of N frames at each resolution, report the "
+				"frame intervals and exit\n"
+				"  --bench N\t\tCapture N frames of a test pattern at each resolution, report the "
+				"frame rate, bandwidth and p50/p99 capture and drain times and exit\n"
+				"  --pattern NAME\tTest pattern for --bench: bar, square, bw or dli\n"
+				"  --bench-multi N\tCapture N frames from one camera, then from every camera in "
+				"--cameras at once, report the frame rates and exit\n"
+				"  --cameras CS,...\tSPI chip selects of up to 4 cameras for --bench-multi\n"
+				"  --bench-video\t\tStream each still size and video preset, report the frame "
+				"rate and bandwidth and exit\n"
+				"  --bench-jpeg FILE...\tMeasure the scalar and vector JPEG validation rates on "
+				"captured samples and exit\n"
+				"  --preroll KB\t\tKeep up to KB kilobytes of frames from before each press and "
+				"start the clip with them\n"
+				"  --zsl\t\t\tSave a zero shutter lag still from the moment of each press\n"
+				"  --snapshot\t\tSave a 2592x1944 still at the start of each session\n"
+				"  --roi X,Y,WxH\t\tOnly capture this region of the 2592x1944 sensor\n"
+				"  --zoom N\t\tZoom N times into the centre of the sensor, up to 8\n"
+				"  --frame-budget KB\tAdjust the JPEG quality so frames stay near KB kilobytes\n"
+				"  --auto-res FPS\tStep the resolution up or down to hold FPS frames per second\n"
 				"  -h, --help\t\tDisplay this screen and exit\n"
-				"  -v, --version\t\tDisplay the software version number and exit\n");
+				"  -v, --version\t\tDisplay the software version number and exit\n"
+				"Control socket %s accepts: press, stop, still, status, quit\n",
+				control_socket_path);
 			return 0;
 		}
 		// Show version
@@ -106,20 +395,194 @@ int main(int argc, char * argv[])
 		}
 	}
 
-	do {
-		pthread_create(&doorbell_thread, NULL, doorbell_thread_handler, NULL);
-		pthread_join(doorbell_thread, NULL);
-	} while(!runonce);
+	// The camera module keeps the region and programs it whenever the sensor is configured
+	if(porch_roi_enabled && Camera_set_roi(&porch_roi) < 0) { return 1; }
+	if(porch_zoom > 1 && Camera_set_zoom(porch_zoom) < 0) { return 1; }
+
+	Camera_set_frame_budget(frame_budget_kb * 1024);
+	Camera_set_auto_resolution(auto_resolution_fps, RES_320x240, RES_2592x1944);
+
+	if(run_pipeline_benchmark_only) { return run_pipeline_benchmark(); }
+
+	if(burst_benchmark_frames > 0) { return run_burst_benchmark(burst_benchmark_frames); }
+
+	if(run_video_benchmark_only) { return run_video_benchmark(); }
+
+	if(capture_benchmark_frames > 0) { return run_capture_benchmark(capture_benchmark_frames); }
+
+	if(multi_benchmark_frames > 0) { return run_multi_benchmark(multi_benchmark_frames); }
+
+	if(jpeg_benchmark_first_file > 0)
+	{
+		return run_jpeg_benchmark(argv + jpeg_benchmark_first_file,
+								  argc - jpeg_benchmark_first_file);
+	}
+
+	// Signals are delivered through the event loop, so block them before any thread starts
+	sigset_t signal_mask;
+	sigemptyset(&signal_mask);
+	sigaddset(&signal_mask, SIGINT);
+	sigaddset(&signal_mask, SIGTERM);
+	sigaddset(&signal_mask, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &signal_mask, NULL);
+
+	// In standby the camera is brought up once and kept configured for every visitor
+	if(!camera_cold_start_per_press)
+	{
+		// A restart finds the sensor still configured and skips reprogramming it
+		Camera_set_checkpoint_file(sensor_checkpoint_path);
+
+		if(Camera_init(camera_i2c_bus, camera_spi_bus, camera_spi_cs) < 0)
+		{
+			ERROR_PRINTLN("Camera unavailable, exiting");
+			Camera_shutdown();
+			return 1;
+		}
+
+		Camera_sleep();
+	}
+
+	// The pre-roll and zero shutter lag need the camera running between visitors, which a cold
+	// start never has
+	if((preroll_budget_kb > 0 || zero_shutter_lag) && camera_cold_start_per_press)
+	{
+		ERROR_PRINTLN("Pre-roll and zero shutter lag need a standby camera, ignoring");
+		zero_shutter_lag = false;
+	}
+	else if(preroll_budget_kb > 0)
+	{
+		preroll = PreRoll_create(preroll_budget_kb * 1024, PREROLL_MAX_FRAMES);
+	}
+
+	// Every pipeline frame then becomes the still a press would get
+	Camera_set_zsl(zero_shutter_lag);
+
+	Button_init(doorbell_button_gpio);
+
+	int epoll_fd	 = epoll_create1(EPOLL_CLOEXEC);
+	button_fd		 = Button_open_event_fd(doorbell_button_gpio);
+	session_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	signal_fd		 = signalfd(-1, &signal_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	control_fd		 = open_control_socket();
+
+	int exit_code = 0;
+
+	// Without them there is no event loop to run, but the camera and sockets still need releasing
+	if(epoll_fd < 0 || session_timer_fd < 0 || signal_fd < 0)
+	{
+		ERROR_PRINTLN("Unable to create event loop descriptors: return %d", errno);
+		exit_code = 1;
+	}
+	else
+	{
+		add_epoll_fd(epoll_fd, session_timer_fd, EPOLLIN);
+		add_epoll_fd(epoll_fd, signal_fd, EPOLLIN);
+
+		if(button_fd >= 0) { add_epoll_fd(epoll_fd, button_fd, EPOLLPRI | EPOLLERR); }
+		if(control_fd >= 0) { add_epoll_fd(epoll_fd, control_fd, EPOLLIN); }
+
+		// Frames are written asynchronously so a stalled card never holds up the camera, and
+		// readers of the latest frame only ever see complete ones. A whole pre-roll is queued at
+		// once.
+		if(FrameWriter_init(FRAME_WRITE_QUEUE + (preroll != NULL ? PREROLL_MAX_FRAMES : 0)) == 0)
+		{
+			FramePublisher_init(capture_filename,
+								latest_frame_shm_name,
+								Camera_frame_capacity(RES_2592x1944));
+		}
+
+		pthread_create(&capture_thread, NULL, capture_thread_handler, NULL);
+
+		run_event_loop(epoll_fd);
+
+		pthread_mutex_lock(&worker_lock);
+		workers_running = false;
+		capture_enabled = false;
+		pthread_cond_broadcast(&capture_cond);
+		pthread_mutex_unlock(&worker_lock);
+
+		pthread_join(capture_thread, NULL);
+		FrameWriter_shutdown();
+		FramePublisher_shutdown();
+	}
+
+	PreRoll_destroy(preroll);
+
+	if(control_fd >= 0)
+	{
+		close(control_fd);
+		unlink(control_socket_path);
+	}
+
+	Button_close_event_fd(button_fd);
+
+	if(session_timer_fd >= 0) { close(session_timer_fd); }
+	if(signal_fd >= 0) { close(signal_fd); }
+	if(epoll_fd >= 0) { close(epoll_fd); }
+
+	if(!camera_cold_start_per_press) { Camera_shutdown(); }
+
+	return exit_code;
 }
 
 /**
- * Function for handling use of doorbell on its own thread
- * @param arg Unused
- * @return Unused
+ * Dispatch button, timer, signal and control socket events until shutdown is requested
+ * @param epoll_fd The epoll instance watching every event source
+ */
+static void run_event_loop(int epoll_fd)
+{
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+
+	DEBUG_PRINTLN("Waiting for doorbell events");
+
+	while(event_loop_running)
+	{
+		int count = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+
+		if(count < 0)
+		{
+			if(errno == EINTR) { continue; }
+
+			ERROR_PRINTLN("epoll wait failed: return %d", errno);
+			break;
+		}
+
+		for(int i = 0; i < count; i++)
+		{
+			int fd = events[i].data.fd;
+
+			if(fd == button_fd)
+			{
+				if(Button_handle_event(button_fd)) { handle_button_press(); }
+			}
+			else if(fd == session_timer_fd) { handle_session_timer(); }
+			else if(fd == signal_fd) { handle_signal(); }
+			else if(fd == control_fd) { handle_control_connection(epoll_fd); }
+			else
+			{
+				handle_control_client(epoll_fd, fd);
+			}
+		}
+	}
+}
+
+/**
+ * React to a doorbell press by starting a recording session, optionally after a random pause
  */
-static void * doorbell_thread_handler(void * arg)
+static void handle_button_press()
 {
-	pthread_t camera_thread;
+	if(doorbell_state != DOORBELL_IDLE)
+	{
+		DEBUG_PRINTLN("Doorbell pressed while a session is active, ignoring");
+		return;
+	}
+
+	pthread_mutex_lock(&worker_lock);
+	press_time_us = Timer_now_us();
+	pthread_mutex_unlock(&worker_lock);
+
+	// The still is the frame already captured when the button went down
+	if(zero_shutter_lag) { save_still(press_time_us); }
 
 	// Get random post-button pause time if needed
 	const unsigned int button_press_pause_time =
@@ -128,32 +591,1314 @@ static void * doorbell_thread_handler(void * arg)
 			 button_press_pause_min_ms) :
 			  0;
 
-	Camera_init(2, 1, 0);
-	Button_init(doorbell_button_gpio);
-	Button_wait_for_press(doorbell_button_gpio, button_press_pause_time);
+	if(button_press_pause_time > 0)
+	{
+		doorbell_state = DOORBELL_PAUSED;
+		arm_session_timer(button_press_pause_time);
+	}
+	else
+	{
+		start_recording();
+	}
+}
+
+/**
+ * Advance the session when its timer expires
+ */
+static void handle_session_timer()
+{
+	unsigned long long expirations;
 
-	// Run doorbell video for 30 seconds
-	pthread_create(&camera_thread, NULL, camera_thread_handler, NULL);
-	sleep(doorbell_video_runtime_s);
-	pthread_kill(camera_thread, 0);
+	if(read(session_timer_fd, &expirations, sizeof(expirations)) < 0) { return; }
 
-	Camera_shutdown();
+	if(doorbell_state == DOORBELL_PAUSED) { start_recording(); }
+	else if(doorbell_state == DOORBELL_RECORDING)
+	{
+		stop_recording();
 
-	return 0;
+		if(runonce) { event_loop_running = false; }
+	}
+}
+
+/**
+ * Stop the event loop on a termination signal
+ */
+static void handle_signal()
+{
+	struct signalfd_siginfo info;
+
+	if(read(signal_fd, &info, sizeof(info)) != sizeof(info)) { return; }
+
+	if(info.ssi_signo == SIGINT || info.ssi_signo == SIGTERM)
+	{
+		DEBUG_PRINTLN("Received signal %u, shutting down", info.ssi_signo);
+		event_loop_running = false;
+	}
+}
+
+/**
+ * Accept a new client on the control socket and watch it for a command
+ * @param epoll_fd The event loop epoll instance
+ */
+static void handle_control_connection(int epoll_fd)
+{
+	int client_fd = accept4(control_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+	if(client_fd < 0)
+	{
+		ERROR_PRINTLN("Control socket accept failed: return %d", errno);
+		return;
+	}
+
+	if(add_epoll_fd(epoll_fd, client_fd, EPOLLIN | EPOLLRDHUP) < 0) { close(client_fd); }
+}
+
+/**
+ * Run a single command from a control client, reply and close the connection
+ * @param epoll_fd The event loop epoll instance
+ * @param client_fd The connected client socket
+ */
+static void handle_control_client(int epoll_fd, int client_fd)
+{
+	char command[CONTROL_COMMAND_MAX];
+	char reply[1792];
+
+	int length = read(client_fd, command, sizeof(command) - 1);
+
+	if(length > 0)
+	{
+		command[length] = '\0';
+		command[strcspn(command, "\r\n")] = '\0';
+
+		if(strcmp(command, "press") == 0)
+		{
+			handle_button_press();
+			snprintf(reply, sizeof(reply), "ok\n");
+		}
+		else if(strcmp(command, "stop") == 0)
+		{
+			if(doorbell_state == DOORBELL_RECORDING) { stop_recording(); }
+			snprintf(reply, sizeof(reply), "ok\n");
+		}
+		else if(strcmp(command, "still") == 0)
+		{
+			snprintf(reply,
+					 sizeof(reply),
+					 save_still(Timer_now_us()) == 0 ? "ok\n" : "not saved\n");
+		}
+		else if(strcmp(command, "status") == 0)
+		{
+			pthread_mutex_lock(&worker_lock);
+			CAMERA_POWER_STATS power;
+			Camera_get_power_stats(&power);
+			CAMERA_WAIT_STATS wait;
+			Camera_get_wait_stats(&wait);
+			FRAME_WRITER_STATS writer;
+			FrameWriter_get_stats(&writer);
+			FRAME_PUBLISHER_STATS publisher;
+			FramePublisher_get_stats(&publisher);
+			PREROLL_STATS pre;
+			PreRoll_get_stats(preroll, &pre);
+			CAMERA_ZSL_STATS zsl;
+			Camera_get_zsl_stats(&zsl);
+			CAMERA_SNAPSHOT_STATS snapshot;
+			Camera_get_snapshot_stats(&snapshot);
+			CAMERA_RATE_STATS rate;
+			Camera_get_rate_stats(&rate);
+			CAMERA_AUTORES_STATS autores;
+			Camera_get_auto_resolution_stats(&autores);
+
+			unsigned long long latency_avg_us =
+				first_frame_latency_count > 0 ?
+					  first_frame_latency_sum_us / first_frame_latency_count :
+					  0;
+
+			snprintf(reply,
+					 sizeof(reply),
+					 "state %d captured %lu dropped %lu rejected %lu mode %s first_frame_us last "
+					 "%llu min %llu max %llu avg %llu count %lu sensor_ms awake %llu standby %llu "
+					 "wake_us last %llu max %llu est_power_mw %u polls_per_frame %.1f "
+					 "wait_cpu_us_per_frame %llu write_queue %u max %u write_us last %llu avg %llu "
+					 "max %llu write_failed %lu writer %s published file %lu shared %lu preroll "
+					 "frames %u kb %u ms %llu spliced %lu dropped %lu zsl stills %lu misses %lu "
+					 "press_to_still_us last %llu avg %llu max %llu still_age_us last %llu max "
+					 "%llu snapshots %lu switch_us %llu regs %u capture_us %llu restore_us %llu "
+					 "regs %u preview_gap_us last %llu max %llu frame_bytes target %u last %u avg "
+					 "%u qscale %u over_budget %lu adjustments %lu resolution %s target_fps %u "
+					 "frame_us %llu readout_us %llu spi_kb_per_sec %llu steps up %lu down %lu\n",
+					 doorbell_state,
+					 frames_captured,
+					 frames_dropped,
+					 Camera_rejected_frames(),
+					 camera_cold_start_per_press ? "cold" : "standby",
+					 first_frame_latency_us,
+					 first_frame_latency_min_us,
+					 first_frame_latency_max_us,
+					 latency_avg_us,
+					 first_frame_latency_count,
+					 power.awake_ms,
+					 power.standby_ms,
+					 power.last_wake_us,
+					 power.max_wake_us,
+					 power.est_average_power_mw,
+					 wait.frames > 0 ? (double) wait.polls / wait.frames : 0.0,
+					 wait.frames > 0 ? wait.wait_cpu_us / wait.frames : 0,
+					 writer.queue_depth,
+					 writer.max_queue_depth,
+					 writer.last_latency_us,
+					 writer.average_latency_us,
+					 writer.max_latency_us,
+					 writer.failed,
+					 writer.io_uring ? "io_uring" : "threads",
+					 publisher.file_published,
+					 publisher.shared_published,
+					 pre.frames,
+					 pre.bytes / 1024,
+					 pre.duration_us / 1000,
+					 pre.spliced,
+					 pre.dropped,
+					 zsl.stills,
+					 zsl.misses,
+					 zsl.last_latency_us,
+					 zsl.average_latency_us,
+					 zsl.max_latency_us,
+					 zsl.last_age_us,
+					 zsl.max_age_us,
+					 snapshot.snapshots,
+					 snapshot.switch_us,
+					 snapshot.registers_switched,
+					 snapshot.capture_us,
+					 snapshot.restore_us,
+					 snapshot.registers_restored,
+					 snapshot.last_preview_gap_us,
+					 snapshot.max_preview_gap_us,
+					 rate.target_bytes,
+					 rate.last_bytes,
+					 rate.average_bytes,
+					 rate.qscale,
+					 rate.over_budget,
+					 rate.adjustments,
+					 resolution_names[autores.resolution],
+					 autores.target_fps,
+					 autores.frame_us,
+					 autores.readout_us,
+					 autores.spi_kb_per_sec,
+					 autores.steps_up,
+					 autores.steps_down);
+			pthread_mutex_unlock(&worker_lock);
+		}
+		else if(strcmp(command, "quit") == 0)
+		{
+			event_loop_running = false;
+			snprintf(reply, sizeof(reply), "ok\n");
+		}
+		else
+		{
+			snprintf(reply, sizeof(reply), "unknown command\n");
+		}
+
+		if(write(client_fd, reply, strlen(reply)) < 0)
+		{
+			ERROR_PRINTLN("Control reply failed: return %d", errno);
+		}
+	}
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_fd, NULL);
+	close(client_fd);
+}
+
+/**
+ * Let the capture worker run and schedule the end of the video session
+ */
+static void start_recording()
+{
+	DEBUG_PRINTLN("Starting %d second doorbell video", doorbell_video_runtime_s);
+
+	doorbell_state = DOORBELL_RECORDING;
+	arm_session_timer(doorbell_video_runtime_s * 1000);
+
+	pthread_mutex_lock(&worker_lock);
+	capture_enabled = true;
+	capture_session++;
+	pthread_cond_signal(&capture_cond);
+	pthread_mutex_unlock(&worker_lock);
+}
+
+/**
+ * Park the capture worker and return to waiting for a press
+ */
+static void stop_recording()
+{
+	DEBUG_PRINTLN("Doorbell video finished");
+
+	doorbell_state = DOORBELL_IDLE;
+	arm_session_timer(0);
+
+	pthread_mutex_lock(&worker_lock);
+	capture_enabled = false;
+	pthread_cond_signal(&capture_cond);
+	pthread_mutex_unlock(&worker_lock);
+}
+
+/**
+ * Arm the one-shot session timer
+ * @param time_ms The time until expiry, or 0 to disarm the timer
+ */
+static void arm_session_timer(unsigned int time_ms)
+{
+	struct itimerspec timer_value;
+	memset(&timer_value, 0, sizeof(timer_value));
+
+	timer_value.it_value.tv_sec	 = time_ms / 1000;
+	timer_value.it_value.tv_nsec = (time_ms % 1000) * 1000000L;
+
+	if(timerfd_settime(session_timer_fd, 0, &timer_value, NULL) < 0)
+	{
+		ERROR_PRINTLN("Unable to arm session timer: return %d", errno);
+	}
+}
+
+/**
+ * Create the listening Unix socket used to control the doorbell at runtime
+ * @return The socket descriptor, or -1 if the control interface is unavailable
+ */
+static int open_control_socket()
+{
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, control_socket_path, sizeof(address.sun_path) - 1);
+
+	int socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+	if(socket_fd < 0)
+	{
+		ERROR_PRINTLN("Unable to create control socket");
+		return -1;
+	}
+
+	unlink(control_socket_path);
+
+	if(bind(socket_fd, (struct sockaddr *) &address, sizeof(address)) < 0 ||
+	   listen(socket_fd, 4) < 0)
+	{
+		ERROR_PRINTLN("Unable to listen on %s", control_socket_path);
+		close(socket_fd);
+		return -1;
+	}
+
+	DEBUG_PRINTLN("Control socket listening on %s", control_socket_path);
+	return socket_fd;
 }
 
 /**
- * Function for handling use of camera video on its own thread
+ * Register a descriptor with the event loop
+ * @param epoll_fd The epoll instance
+ * @param fd The descriptor to watch
+ * @param events The epoll event mask
+ * @return 0 on success or a negative value on failure
+ */
+static int add_epoll_fd(int epoll_fd, int fd, unsigned int events)
+{
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events  = events;
+	event.data.fd = fd;
+
+	int err = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+	if(err < 0) { ERROR_PRINTLN("Unable to watch fd %d: return %d", fd, errno); }
+
+	return err;
+}
+
+/**
+ * Long-lived worker that captures frames while a recording session is active
  * @param arg Unused
  * @return Unused
  */
-static void * camera_thread_handler(void * arg)
+static void * capture_thread_handler(void * arg)
 {
-	while(1)
+	unsigned long current_session = 0;
+	bool		  camera_online	   = !camera_cold_start_per_press;
+	bool		  camera_asleep	   = camera_online;
+	bool		  camera_staged	   = false;
+	bool		  pipeline_active  = false;
+	bool		  zsl_active	   = false;
+	bool		  zsl_wanted	   = zero_shutter_lag;
+	CLIP *		  clip			   = NULL;
+
+	pthread_mutex_lock(&worker_lock);
+
+	while(workers_running)
 	{
-		Camera_single_capture();
-		Camera_save_capture_to_file("image.jpg");
+		if(!capture_enabled)
+		{
+			// The clip is finished in the background before the camera is put away, so it is
+			// playable straight away without holding up the pre-roll
+			if(clip != NULL)
+			{
+				pthread_mutex_unlock(&worker_lock);
+				Clip_close_async(clip);
+				pthread_mutex_lock(&worker_lock);
+				clip = NULL;
+				continue;
+			}
+
+			if(preroll != NULL)
+			{
+				pthread_mutex_unlock(&worker_lock);
+				capture_preroll_frame(&camera_asleep, &pipeline_active);
+				pthread_mutex_lock(&worker_lock);
+				continue;
+			}
+
+			// Without a pre-roll the camera keeps the latest frame from a thread of its own
+			if(zsl_wanted && !zsl_active)
+			{
+				pthread_mutex_unlock(&worker_lock);
+
+				if(camera_asleep)
+				{
+					Camera_wake();
+					camera_asleep = false;
+				}
+
+				zsl_active		= Camera_start_zsl() == 0;
+				zsl_wanted		= zsl_active;
+				pipeline_active = zsl_active;
+				pthread_mutex_lock(&worker_lock);
+				continue;
+			}
+
+			if(zsl_active)
+			{
+				pthread_cond_wait(&capture_cond, &worker_lock);
+				continue;
+			}
+
+			if(pipeline_active)
+			{
+				pthread_mutex_unlock(&worker_lock);
+				Camera_stop_pipeline();
+				pthread_mutex_lock(&worker_lock);
+				pipeline_active = false;
+				continue;
+			}
+
+			// Between visitors the sensor is either shut down or kept configured in standby
+			if(camera_online && camera_cold_start_per_press)
+			{
+				pthread_mutex_unlock(&worker_lock);
+				Camera_shutdown();
+				pthread_mutex_lock(&worker_lock);
+				camera_online = false;
+				camera_staged = false;
+				continue;
+			}
+
+			if(camera_online && !camera_asleep)
+			{
+				pthread_mutex_unlock(&worker_lock);
+				Camera_sleep();
+				pthread_mutex_lock(&worker_lock);
+				camera_asleep = true;
+				continue;
+			}
+
+			pthread_cond_wait(&capture_cond, &worker_lock);
+			continue;
+		}
+
+		bool first_frame = current_session != capture_session;
+		current_session	 = capture_session;
+
+		pthread_mutex_unlock(&worker_lock);
+
+		// Each session records into its own clip, starting with the frames from before the press
+		if(first_frame)
+		{
+			Clip_close_async(clip);
+			clip = open_event_clip();
+
+			if(clip != NULL) { PreRoll_splice(preroll, clip); }
+		}
+
+		// The session takes over the running pipeline from the zero shutter lag thread
+		if(zsl_active)
+		{
+			Camera_stop_zsl();
+			zsl_active = false;
+		}
+
+		// A cold start captures its first frame after the minimal init stage, and the rest of
+		// the sensor configuration runs once that frame has been handed off. Exposure settles
+		// over the frames that follow rather than stalling the session.
+		if(!camera_online)
+		{
+			if(Camera_init_minimal(camera_i2c_bus, camera_spi_bus, camera_spi_cs) < 0)
+			{
+				ERROR_PRINTLN("Camera unavailable, skipping this session");
+				Camera_shutdown();
+
+				pthread_mutex_lock(&worker_lock);
+				wait_for_session_end(current_session);
+				continue;
+			}
+
+			camera_online = true;
+			camera_staged = true;
+		}
+		else if(camera_staged)
+		{
+			Camera_stop_pipeline();
+			pipeline_active = false;
+
+			Camera_init_complete(RES_320x240, EFFECT_NORMAL);
+			camera_staged = false;
+		}
+		else if(camera_asleep)
+		{
+			Camera_wake();
+			camera_asleep = false;
+		}
+
+		// The next frame is already exposing while this one is handed to storage
+		if(!pipeline_active)
+		{
+			if(Camera_start_pipeline() < 0)
+			{
+				pthread_mutex_lock(&worker_lock);
+				wait_for_session_end(current_session);
+				continue;
+			}
+
+			pipeline_active = true;
+		}
+
+		CAMERA_FRAME * frame = Camera_pipeline_next();
+
+		// The writer holds its own reference to the frame, so neither output copies it. The
+		// latest frame file is skipped while the previous one is still being written, which
+		// only shows in the publisher statistics, while a frame missing from the clip is dropped.
+		bool dropped = frame == NULL || Clip_append(clip, frame) < 0;
+
+		if(frame != NULL) { FramePublisher_publish(frame); }
+
+		FramePool_release(frame);
+
+		// One full resolution still per visitor, taken once the first preview frame is out
+		if(first_frame && full_resolution_snapshot)
+		{
+			CAMERA_FRAME * snapshot = Camera_snapshot();
+			write_still(snapshot, "snapshot");
+			FramePool_release(snapshot);
+		}
+
+		pthread_mutex_lock(&worker_lock);
+		frames_captured++;
+
+		if(dropped) { frames_dropped++; }
+
+		if(first_frame) { record_first_frame_latency(Timer_now_us()); }
+	}
+
+	pthread_mutex_unlock(&worker_lock);
+
+	Clip_close_async(clip);
+	Camera_stop_zsl();
+
+	if(pipeline_active) { Camera_stop_pipeline(); }
+	if(camera_online && camera_cold_start_per_press) { Camera_shutdown(); }
+
+	return 0;
+}
+
+/**
+ * Park the capture worker until the given session ends, called with worker_lock held
+ * @param session The session that cannot be captured
+ */
+static void wait_for_session_end(unsigned long session)
+{
+	while(workers_running && capture_enabled && session == capture_session)
+	{
+		pthread_cond_wait(&capture_cond, &worker_lock);
+	}
+}
+
+/**
+ * Add a press to first JPEG sample to the latency statistics, called with worker_lock held
+ * @param frame_time_us The time the first frame of the session was read out
+ */
+static void record_first_frame_latency(unsigned long long frame_time_us)
+{
+	first_frame_latency_us = frame_time_us - press_time_us;
+	first_frame_latency_sum_us += first_frame_latency_us;
+
+	if(first_frame_latency_count == 0 || first_frame_latency_us < first_frame_latency_min_us)
+	{
+		first_frame_latency_min_us = first_frame_latency_us;
+	}
+
+	if(first_frame_latency_us > first_frame_latency_max_us)
+	{
+		first_frame_latency_max_us = first_frame_latency_us;
+	}
+
+	first_frame_latency_count++;
+
+	DEBUG_PRINTLN("Press to first JPEG: %llu us (%s)",
+				  first_frame_latency_us,
+				  camera_cold_start_per_press ? "cold" : "standby");
+}
+
+/**
+ * Capture one frame into the pre-roll between visitors, bringing the camera up if needed
+ * @param camera_asleep Whether the sensor is in standby, updated if it is woken
+ * @param pipeline_active Whether the capture pipeline is running, updated if it is started
+ */
+static void capture_preroll_frame(bool * camera_asleep, bool * pipeline_active)
+{
+	if(*camera_asleep)
+	{
+		Camera_wake();
+		*camera_asleep = false;
+	}
+
+	if(!*pipeline_active)
+	{
+		if(Camera_start_pipeline() < 0)
+		{
+			Timer_delay_ms(PREROLL_RETRY_MS);
+			return;
+		}
+
+		*pipeline_active = true;
+	}
+
+	CAMERA_FRAME * frame = Camera_pipeline_next();
+
+	PreRoll_store(preroll, frame);
+	FramePool_release(frame);
+}
+
+/**
+ * Save the zero shutter lag still from a moment to its own file in the background
+ * @param request_us The moment the still was asked for
+ * @return 0 if the still is being written or -1 if there was no frame or it could not be queued
+ */
+static int save_still(unsigned long long request_us)
+{
+	FRAME * still = Camera_zsl_capture(request_us);
+
+	if(still == NULL) { return -1; }
+
+	DEBUG_PRINTLN("Saving a still %llu us old",
+				  request_us > still->timestamp_us ? request_us - still->timestamp_us : 0);
+
+	int result = write_still(still, "still");
+	FramePool_release(still);
+
+	return result;
+}
+
+/**
+ * Write a still to its own file in the still directory in the background. Creating the file is
+ * left to the writer's job thread, as this runs on the event loop.
+ * @param still The frame to write, the writer holds its own reference
+ * @param kind The start of the file name
+ * @return 0 if the still is being written or -1 if it could not be queued
+ */
+static int write_still(FRAME * still, const char * kind)
+{
+	time_t	  now = time(NULL);
+	struct tm local;
+
+	if(still == NULL) { return -1; }
+
+	if(!acquire_still_slot())
+	{
+		ERROR_PRINTLN("Dropping the %s, %d stills are still being written", kind, STILL_MAX_WRITES);
+		return -1;
+	}
+
+	STILL_JOB * job = malloc(sizeof(STILL_JOB));
+
+	if(job == NULL)
+	{
+		release_still_slot();
+		return -1;
+	}
+
+	job->still = FramePool_retain(still);
+	job->kind  = kind;
+
+	localtime_r(&now, &local);
+	snprintf(job->filename, sizeof(job->filename), "%s/%s-", still_directory, kind);
+	strftime(job->filename + strlen(job->filename),
+			 sizeof(job->filename) - strlen(job->filename),
+			 "%Y%m%d-%H%M%S",
+			 &local);
+	snprintf(job->filename + strlen(job->filename),
+			 sizeof(job->filename) - strlen(job->filename),
+			 "-%lu.jpg",
+			 __atomic_fetch_add(&stills_saved, 1, __ATOMIC_RELAXED));
+
+	if(FrameWriter_defer(open_still_file, job) < 0)
+	{
+		ERROR_PRINTLN("Unable to queue the %s", kind);
+		FramePool_release(job->still);
+		free(job);
+		release_still_slot();
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Writer job that creates a still's file and queues the still onto it
+ * @param context The still job, freed by this call
+ */
+static void open_still_file(void * context)
+{
+	STILL_JOB * job	 = context;
+	int			file = -1;
+
+	if(mkdir(still_directory, 0755) == 0 || errno == EEXIST)
+	{
+		unlink(job->filename);
+		file = FrameWriter_open(job->filename);
+	}
+
+	if(file < 0 ||
+	   FrameWriter_write(file, job->still, 0, still_written, (void *) (intptr_t) file) < 0)
+	{
+		ERROR_PRINTLN("Unable to save the %50s", job->kind);
+		FrameWriter_close(file);
+		release_still_slot();
+	}
+
+	FramePool_release(job->still);
+	free(job);
+}
+
+/**
+ * Take one of the STILL_MAX_WRITES still writes without waiting for one to finish
+ * @return true if the caller may write a still, to be given back with release_still_slot()
+ */
+static bool acquire_still_slot()
+{
+	pthread_mutex_lock(&still_lock);
+
+	bool acquired = stills_writing < STILL_MAX_WRITES;
+	if(acquired) { stills_writing++; }
+
+	pthread_mutex_unlock(&still_lock);
+	return acquired;
+}
+
+/**
+ * Give back a still write slot taken with acquire_still_slot()
+ */
+static void release_still_slot()
+{
+	pthread_mutex_lock(&still_lock);
+	stills_writing--;
+	pthread_mutex_unlock(&still_lock);
+}
+
+/**
+ * Close a still file once the writer has finished with it
+ * @param frame The still
+ * @param fd The file descriptor
+ * @param result The number of bytes written or a negative error
+ * @param context The writer file number
+ */
+static void still_written(FRAME * frame, int fd, int result, void * context)
+{
+	FrameWriter_close((int) (intptr_t) context);
+	release_still_slot();
+}
+
+/**
+ * Create the clip for a new session, named after the time it started. Sessions within the same
+ * second get a numbered suffix, and an existing clip is never replaced.
+ * @return the clip, or NULL if it could not be created and the session is not recorded
+ */
+static CLIP * open_event_clip()
+{
+	char	  filename[CLIP_NAME_MAX];
+	char	  started[32];
+	time_t	  now  = time(NULL);
+	CLIP *	  clip = NULL;
+	struct tm local;
+
+	if(mkdir(clip_directory, 0755) < 0 && errno != EEXIST)
+	{
+		ERROR_PRINTLN("Unable to create clip directory: return %d", errno);
+		return NULL;
+	}
+
+	localtime_r(&now, &local);
+	strftime(started, sizeof(started), "%Y%m%d-%H%M%S", &local);
+
+	for(int attempt = 0; attempt < CLIP_NAME_ATTEMPTS && clip == NULL; attempt++)
+	{
+		if(attempt == 0)
+		{
+			snprintf(filename, sizeof(filename), "%s/event-%s.clip", clip_directory, started);
+		}
+		else
+		{
+			snprintf(filename,
+					 sizeof(filename),
+					 "%s/event-%s-%d.clip",
+					 clip_directory,
+					 started,
+					 attempt);
+		}
+
+		clip = Clip_create(filename, CLIP_PREALLOCATE);
+		if(clip == NULL && errno != EEXIST) { break; }
+	}
+
+	if(clip != NULL) { DEBUG_PRINTLN("Recording to %50s", filename); }
+	else
+	{
+		ERROR_PRINTLN("No clip created for this session");
+	}
+
+	return clip;
+}
+
+/**
+ * Write a frame to the capture file
+ * @param data The frame bytes
+ * @param size The frame size in bytes
+ */
+static void save_frame(const char * data, int size)
+{
+	FILE * output_file = fopen(capture_filename, "w");
+
+	if(output_file == NULL)
+	{
+		ERROR_PRINTLN("Failed to open %50s", capture_filename);
+		return;
+	}
+
+	fwrite(data, sizeof(char), size, output_file);
+
+	if(fclose(output_file) < 0) { ERROR_PRINTLN("Failed to close the image file"); }
+}
+
+/**
+ * Capture and save BENCHMARK_FRAMES frames with the serial capture path
+ * @param[out] wait the capture done wait cost over the run
+ * @return the elapsed time in microseconds
+ */
+static unsigned long long run_serial_frames(CAMERA_WAIT_STATS * wait)
+{
+	Camera_reset_wait_stats();
+	unsigned long long start_us = Timer_now_us();
+
+	for(int i = 0; i < BENCHMARK_FRAMES; i++)
+	{
+		const char * capture;
+
+		Camera_single_capture();
+		int capture_size = Camera_get_capture(&capture);
+		save_frame(capture, capture_size);
+	}
+
+	unsigned long long elapsed_us = Timer_now_us() - start_us;
+	Camera_get_wait_stats(wait);
+	return elapsed_us;
+}
+
+/**
+ * Capture BENCHMARK_FRAMES frames at each resolution, first with the serial capture path and then
+ * with the double buffered engine, saving every frame as the storage worker would. The serial path
+ * runs once polling for capture done continuously and once with the learned wait to show the SPI
+ * polls and CPU time the learned wait saves.
+ * @return 0 on success or 1 if the camera is unavailable
+ */
+static int run_pipeline_benchmark()
+{
+	if(Camera_init(camera_i2c_bus, camera_spi_bus, camera_spi_cs) < 0)
+	{
+		ERROR_PRINTLN("Camera unavailable, cannot run benchmark");
+		Camera_shutdown();
+		return 1;
+	}
+
+	printf("resolution\tserial fps\tpipelined fps\tgain\t\tpolls/frame\t\twait cpu us/frame\n");
+
+	for(int res = RES_320x240; res <= RES_2592x1944; res++)
+	{
+		Camera_set_resolution(res);
+		Camera_wait_for_exposure_settle(1000);
+
+		CAMERA_WAIT_STATS legacy_wait, adaptive_wait;
+
+		Camera_set_adaptive_wait(false);
+		run_serial_frames(&legacy_wait);
+
+		Camera_set_adaptive_wait(true);
+		unsigned long long serial_us = run_serial_frames(&adaptive_wait);
+
+		if(Camera_start_pipeline() < 0) { break; }
+
+		unsigned long long start_us = Timer_now_us();
+
+		for(int i = 0; i < BENCHMARK_FRAMES; i++)
+		{
+			CAMERA_FRAME * frame = Camera_pipeline_next();
+			if(frame == NULL) { continue; }
+
+			save_frame((const char *) frame->data, frame->size);
+			FramePool_release(frame);
+		}
+
+		unsigned long long pipelined_us = Timer_now_us() - start_us;
+		Camera_stop_pipeline();
+
+		double serial_fps	 = BENCHMARK_FRAMES * 1000000.0 / serial_us;
+		double pipelined_fps = BENCHMARK_FRAMES * 1000000.0 / pipelined_us;
+
+		printf("%s\t%.2f\t\t%.2f\t\t%+.1f%%\t\t%.1f -> %.1f\t%llu -> %llu\n",
+			   resolution_names[res],
+			   serial_fps,
+			   pipelined_fps,
+			   (pipelined_fps / serial_fps - 1.0) * 100.0,
+			   (double) legacy_wait.polls / BENCHMARK_FRAMES,
+			   (double) adaptive_wait.polls / BENCHMARK_FRAMES,
+			   legacy_wait.wait_cpu_us / BENCHMARK_FRAMES,
+			   adaptive_wait.wait_cpu_us / BENCHMARK_FRAMES);
+	}
+
+	Camera_shutdown();
+	return 0;
+}
+
+/**
+ * Capture a burst at each resolution, print the frame intervals, then flush the burst to a clip
+ * to show what storage costs once capture is over
+ * @param count The number of frames per burst
+ * @return 0 on success or 1 if the camera or writer could not be started
+ */
+static int run_burst_benchmark(unsigned int count)
+{
+	CAMERA_FRAME *	   frames[BURST_MAX_FRAMES];
+	unsigned long long intervals_us[BURST_MAX_FRAMES];
+	char			   filename[CLIP_NAME_MAX];
+
+	if(count > BURST_MAX_FRAMES) { count = BURST_MAX_FRAMES; }
+
+	if(Camera_init(camera_i2c_bus, camera_spi_bus, camera_spi_cs) < 0 ||
+	   FrameWriter_init(count) < 0)
+	{
+		ERROR_PRINTLN("Camera unavailable, cannot run benchmark");
+		Camera_shutdown();
+		return 1;
+	}
+
+	mkdir(clip_directory, 0755);
+	printf("resolution\tframes\tfirst ms\tinterval ms min/avg/max\tfps\tflush ms\n");
+
+	for(int res = RES_320x240; res <= RES_2592x1944; res++)
+	{
+		int captured = Camera_burst_capture(count, res, frames, intervals_us);
+		if(captured <= 0) { continue; }
+
+		unsigned long long min_us = 0, max_us = 0, total_us = 0;
+
+		// The first interval includes the trigger, so the sustained rate starts at the second
+		for(int i = 1; i < captured; i++)
+		{
+			if(i == 1 || intervals_us[i] < min_us) { min_us = intervals_us[i]; }
+			if(intervals_us[i] > max_us) { max_us = intervals_us[i]; }
+			total_us += intervals_us[i];
+		}
+
+		snprintf(filename,
+				 sizeof(filename),
+				 "%s/burst-%s.clip",
+				 clip_directory,
+				 resolution_names[res]);
+
+		// Each run replaces the last burst at this resolution
+		unlink(filename);
+
+		unsigned long long flush_start_us = Timer_now_us();
+		CLIP *			   clip			  = Clip_create(filename, 0);
+
+		for(int i = 0; i < captured; i++)
+		{
+			Clip_append(clip, frames[i]);
+			FramePool_release(frames[i]);
+		}
+
+		Clip_close(clip);
+
+		printf("%s\t%d\t%.1f\t\t%.1f / %.1f / %.1f\t\t%.2f\t%.1f\n",
+			   resolution_names[res],
+			   captured,
+			   intervals_us[0] / 1000.0,
+			   min_us / 1000.0,
+			   captured > 1 ? total_us / 1000.0 / (captured - 1) : 0.0,
+			   max_us / 1000.0,
+			   total_us > 0 ? (captured - 1) * 1000000.0 / total_us : 0.0,
+			   (Timer_now_us() - flush_start_us) / 1000.0);
+
+		printf("\tintervals ms:");
+
+		for(int i = 0; i < captured; i++) { printf(" %.1f", intervals_us[i] / 1000.0); }
+
+		printf("\n");
+	}
+
+	FrameWriter_shutdown();
+	Camera_shutdown();
+	return 0;
+}
+
+/**
+ * Stream BENCHMARK_FRAMES frames through the double buffered engine at every still size and video
+ * preset, print the achieved frame rate against the mode's target along with the frame size and
+ * SPI bandwidth, then recommend the largest mode that keeps up
+ * @return 0 on success or 1 if the camera is unavailable
+ */
+static int run_video_benchmark()
+{
+	if(Camera_init(camera_i2c_bus, camera_spi_bus, camera_spi_cs) < 0)
+	{
+		ERROR_PRINTLN("Camera unavailable, cannot run benchmark");
+		Camera_shutdown();
+		return 1;
+	}
+
+	int			 best_res	   = -1;
+	unsigned int best_capacity = 0;
+
+	printf("mode\t\ttarget fps\tachieved fps\tbytes/frame\tKB/s\n");
+
+	for(int res = RES_320x240; res < RES_COUNT; res++)
+	{
+		Camera_set_resolution(res);
+		Camera_wait_for_exposure_settle(1000);
+
+		if(Camera_start_pipeline() < 0) { break; }
+
+		unsigned long long bytes	= 0;
+		int				   captured = 0;
+		unsigned long long start_us = Timer_now_us();
+
+		for(int i = 0; i < BENCHMARK_FRAMES; i++)
+		{
+			CAMERA_FRAME * frame = Camera_pipeline_next();
+			if(frame == NULL) { continue; }
+
+			bytes += frame->size;
+			captured++;
+			FramePool_release(frame);
+		}
+
+		unsigned long long elapsed_us = Timer_now_us() - start_us;
+		Camera_stop_pipeline();
+
+		unsigned int target_fps = Camera_target_fps(res);
+		double		 fps		= captured * 1000000.0 / elapsed_us;
+
+		printf("%s\t%s%u\t\t%.2f\t\t%llu\t\t%.1f\n",
+			   resolution_names[res],
+			   strlen(resolution_names[res]) < 8 ? "\t" : "",
+			   target_fps,
+			   fps,
+			   captured > 0 ? bytes / captured : 0,
+			   bytes / 1024.0 * 1000000.0 / elapsed_us);
+
+		// Still sizes have no target, so they are held to the lowest video rate instead
+		unsigned int needed_fps = target_fps > 0 ? target_fps : Camera_target_fps(RES_1920x1080);
+
+		// Larger modes reserve more of the FIFO, so the frame capacity ranks them by size
+		unsigned int capacity = Camera_frame_capacity(res);
+
+		if(captured == BENCHMARK_FRAMES && fps >= needed_fps * 0.95 && capacity > best_capacity)
+		{
+			best_res	  = res;
+			best_capacity = capacity;
+		}
+	}
+
+	if(best_res >= 0) { printf("Recommended streaming mode: %s\n", resolution_names[best_res]); }
+	else
+	{
+		printf("No mode reached its target frame rate\n");
+	}
+
+	Camera_shutdown();
+	return 0;
+}
+
+/**
+ * Capture count frames of a fixed sensor test pattern at every still size with the serial capture
+ * path, so runs on different days and scenes compress the same content. Prints the frame rate, the
+ * SPI bandwidth and the median and 99th percentile time to capture and to drain each frame.
+ * @param count The number of frames per resolution
+ * @return 0 on success or 1 if the camera is unavailable
+ */
+static int run_capture_benchmark(unsigned int count)
+{
+	unsigned long long * capture_us = calloc(count, sizeof(unsigned long long));
+	unsigned long long * drain_us	= calloc(count, sizeof(unsigned long long));
+
+	if(capture_us == NULL || drain_us == NULL ||
+	   Camera_init(camera_i2c_bus, camera_spi_bus, camera_spi_cs) < 0)
+	{
+		ERROR_PRINTLN("Camera unavailable, cannot run benchmark");
+		Camera_shutdown();
+		free(capture_us);
+		free(drain_us);
+		return 1;
+	}
+
+	Camera_set_test_pattern(benchmark_pattern);
+
+	printf("pattern %s\n", pattern_names[benchmark_pattern]);
+	printf("resolution\tframes\tfps\tMB/s\tcapture us p50/p99\tdrain us p50/p99\n");
+
+	for(int res = RES_320x240; res <= RES_2592x1944; res++)
+	{
+		Camera_set_resolution(res);
+		Camera_wait_for_exposure_settle(1000);
+
+		CAMERA_CAPTURE_TIMING timing;
+		unsigned int		  captured = 0;
+		unsigned long long	  bytes	   = 0;
+		unsigned long long	  start_us = Timer_now_us();
+
+		for(unsigned int i = 0; i < count; i++)
+		{
+			Camera_single_capture();
+			Camera_get_capture_timing(&timing);
+
+			if(timing.size == 0) { continue; }
+
+			capture_us[captured] = timing.capture_us;
+			drain_us[captured]	 = timing.drain_us;
+			bytes += timing.size;
+			captured++;
+		}
+
+		unsigned long long elapsed_us = Timer_now_us() - start_us;
+
+		qsort(capture_us, captured, sizeof(unsigned long long), compare_us);
+		qsort(drain_us, captured, sizeof(unsigned long long), compare_us);
+
+		// Nearest rank percentiles, the last frame stands in for p99 on short runs
+		unsigned int p50 = captured > 0 ? (captured * 50 + 99) / 100 - 1 : 0;
+		unsigned int p99 = captured > 0 ? (captured * 99 + 99) / 100 - 1 : 0;
+
+		printf("%s\t%u\t%.2f\t%.2f\t%llu / %llu\t\t%llu / %llu\n",
+			   resolution_names[res],
+			   captured,
+			   captured * 1000000.0 / elapsed_us,
+			   bytes / 1048576.0 * 1000000.0 / elapsed_us,
+			   captured > 0 ? capture_us[p50] : 0,
+			   captured > 0 ? capture_us[p99] : 0,
+			   captured > 0 ? drain_us[p50] : 0,
+			   captured > 0 ? drain_us[p99] : 0);
+	}
+
+	Camera_clear_test_pattern();
+	Camera_shutdown();
+	free(capture_us);
+	free(drain_us);
+	return 0;
+}
+
+/**
+ * Capture count frames from the first camera alone, then from 2 up to every camera in --cameras at
+ * once through the bus scheduler, and print the aggregate and per camera frame rates to show how
+ * capture on one camera overlaps readout of another
+ * @param count The number of frames per camera
+ * @return 0 on success or 1 if a camera is unavailable
+ */
+static int run_multi_benchmark(unsigned int count)
+{
+	CAMERA * cameras[CAMERA_MAX_INSTANCES];
+	int		 opened = 0;
+
+	// Without --cameras only the doorbell camera is measured
+	if(multi_camera_count == 0) { multi_camera_cs[multi_camera_count++] = camera_spi_cs; }
+
+	if(Camera_init(camera_i2c_bus, camera_spi_bus, multi_camera_cs[0]) < 0)
+	{
+		ERROR_PRINTLN("Camera unavailable, cannot run benchmark");
+		Camera_shutdown();
+		return 1;
+	}
+
+	for(; opened < (int) multi_camera_count; opened++)
+	{
+		cameras[opened] = Camera_open(multi_camera_cs[opened]);
+		if(cameras[opened] == NULL) { break; }
+	}
+
+	if(opened < (int) multi_camera_count)
+	{
+		ERROR_PRINTLN("Camera on chip select %u unavailable", multi_camera_cs[opened]);
+
+		while(opened-- > 0) { Camera_close(cameras[opened]); }
+
+		Camera_shutdown();
+		return 1;
+	}
+
+	printf("cameras\tframes\tfps\tper camera fps\tscaling\tpolls/frame\tdrain ms/frame\n");
+
+	double single_fps = 0.0;
+
+	for(unsigned int active = 1; active <= multi_camera_count; active++)
+	{
+		if(Camera_start_multi(cameras, active) < 0) { break; }
+
+		unsigned int	   index;
+		unsigned long long start_us = Timer_now_us();
+
+		while(1)
+		{
+			CAMERA_MULTI_STATS progress;
+			Camera_get_multi_stats(&progress);
+			if(progress.frames + progress.dropped >= count * active) { break; }
+
+			FramePool_release(Camera_multi_next(&index));
+		}
+
+		unsigned long long elapsed_us = Timer_now_us() - start_us;
+
+		CAMERA_MULTI_STATS stats;
+		Camera_get_multi_stats(&stats);
+		Camera_stop_multi();
+
+		double fps = stats.frames * 1000000.0 / elapsed_us;
+		if(active == 1) { single_fps = fps; }
+
+		printf("%u\t%lu\t%.2f\t", active, stats.frames, fps);
+
+		for(unsigned int i = 0; i < active; i++)
+		{
+			printf("%s%.1f", i > 0 ? "/" : "", stats.camera_frames[i] * 1000000.0 / elapsed_us);
+		}
+
+		printf("\t%.2fx\t%.1f\t\t%.2f\n",
+			   single_fps > 0 ? fps / single_fps : 0.0,
+			   stats.frames > 0 ? (double) stats.polls / stats.frames : 0.0,
+			   stats.frames > 0 ? stats.drain_us / 1000.0 / stats.frames : 0.0);
+	}
+
+	for(int i = 0; i < opened; i++) { Camera_close(cameras[i]); }
+
+	Camera_shutdown();
+	return 0;
+}
+
+/**
+ * Order two microsecond times for qsort()
+ * @param a The first time
+ * @param b The second time
+ * @return less than, equal to or greater than 0 as a is before, at or after b
+ */
+static int compare_us(const void * a, const void * b)
+{
+	unsigned long long first  = *(const unsigned long long *) a;
+	unsigned long long second = *(const unsigned long long *) b;
+
+	return (first > second) - (first < second);
+}
+
+/**
+ * Validate each sample JPEG repeatedly, first with the scalar and then with the vector marker
+ * search, and print the scan rate of each. Samples are wrapped in a dummy leading byte and FIFO
+ * padding as the camera delivers them.
+ * @param files The sample file names
+ * @param count The number of sample files
+ * @return 0 on success or 1 if a sample could not be read
+ */
+static int run_jpeg_benchmark(char * files[], int count)
+{
+	if(!JPEG_vector_scan_available()) { printf("No SSE2 or NEON in this build\n"); }
+
+	printf("sample\tsize\tdimensions\tscalar MB/s\tvector MB/s\n");
+
+	for(int i = 0; i < count; i++)
+	{
+		FILE * sample_file = fopen(files[i], "r");
+
+		if(sample_file == NULL)
+		{
+			ERROR_PRINTLN("Failed to open %50s", files[i]);
+			return 1;
+		}
+
+		fseek(sample_file, 0, SEEK_END);
+		long		 file_size = ftell(sample_file);
+		unsigned int length	   = 1 + file_size + JPEG_FIFO_PADDING;
+		rewind(sample_file);
+
+		unsigned char * sample = calloc(length, 1);
+		size_t			read   = sample != NULL ? fread(sample + 1, 1, file_size, sample_file) : 0;
+		fclose(sample_file);
+
+		if(read != (size_t) file_size)
+		{
+			ERROR_PRINTLN("Failed to read %50s", files[i]);
+			free(sample);
+			return 1;
+		}
+
+		JPEG_INFO	info;
+		JPEG_STATUS status = JPEG_VALID;
+		double		rate_mbps[2];
+
+		for(int vector = 0; vector < 2; vector++)
+		{
+			JPEG_set_vector_scan(vector);
+
+			unsigned long	   runs		= 0;
+			unsigned long long start_us = Timer_now_us();
+			unsigned long long elapsed_us;
+
+			do
+			{
+				status = JPEG_validate(sample, length, &info);
+				runs++;
+				elapsed_us = Timer_now_us() - start_us;
+			} while(elapsed_us < JPEG_BENCHMARK_US);
+
+			// Only the image itself is scanned, not the leading byte or the FIFO padding. Bytes per
+			// microsecond is megabytes per second.
+			rate_mbps[vector] = (double) runs * (info.end - info.start) / elapsed_us;
+		}
+
+		if(status == JPEG_VALID)
+		{
+			printf("%s\t%u\t%ux%u\t%.1f\t\t%.1f\n",
+				   files[i],
+				   info.end - info.start,
+				   info.width,
+				   info.height,
+				   rate_mbps[0],
+				   rate_mbps[1]);
+		}
+		else
+		{
+			printf("%s\trejected: %s\n", files[i], JPEG_status_name(status));
+		}
+
+		free(sample);
 	}
 
+	JPEG_set_vector_scan(true);
 	return 0;
 }
@@ -0,0 +1,282 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2021 Lena Voytek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Pre-Roll
+ *
+ * This module keeps the most recent frames captured between visitors in a fixed block of memory,
+ * so an event clip can start with the approach that came before the press
+ *
+ * Frames are copied into a byte ring, so the memory used depends on the budget and not on the
+ * worst case JPEG size of a pool frame. Each stored frame is a storage-less pool frame pointing
+ * into the ring, which lets the writer hold it while it is spliced into a clip without a copy.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "Debug.h"
+
+#include "PreRoll.h"
+
+struct PREROLL
+{
+	pthread_mutex_t lock;
+	unsigned char * arena;
+	unsigned int	budget;
+	unsigned int	head;
+	FRAME_POOL *	descriptors;
+	FRAME **		frames;
+	unsigned int	max_frames;
+	unsigned int	first;
+	unsigned int	count;
+	unsigned int	bytes;
+	bool			draining;
+	PREROLL_STATS	stats;
+};
+
+static int	reserveSpace(PREROLL * preroll, unsigned int size);
+static void evictOldest(PREROLL * preroll);
+
+/**
+ * Allocate a pre-roll ring
+ * @param budget_bytes the memory to hold frames in
+ * @param max_frames the most frames held at once
+ * @return the ring, or NULL on failure
+ */
+PREROLL * PreRoll_create(unsigned int budget_bytes, unsigned int max_frames)
+{
+	PREROLL * preroll = calloc(1, sizeof(PREROLL));
+
+	if(preroll == NULL) { return NULL; }
+
+	pthread_mutex_init(&preroll->lock, NULL);
+	preroll->arena		 = malloc(budget_bytes);
+	preroll->frames		 = calloc(max_frames, sizeof(FRAME *));
+	preroll->descriptors = FramePool_create(max_frames, 0);
+
+	if(preroll->arena == NULL || preroll->frames == NULL || preroll->descriptors == NULL)
+	{
+		ERROR_PRINTLN("Unable to allocate a %u byte pre-roll", budget_bytes);
+		PreRoll_destroy(preroll);
+		return NULL;
+	}
+
+	preroll->budget		= budget_bytes;
+	preroll->max_frames = max_frames;
+
+	return preroll;
+}
+
+/**
+ * Free a pre-roll ring. Frames spliced into a clip must have been written first.
+ * @param preroll the ring, may be NULL
+ */
+void PreRoll_destroy(PREROLL * preroll)
+{
+	if(preroll == NULL) { return; }
+
+	while(preroll->count > 0) { evictOldest(preroll); }
+
+	FramePool_destroy(preroll->descriptors);
+	pthread_mutex_destroy(&preroll->lock);
+	free(preroll->frames);
+	free(preroll->arena);
+	free(preroll);
+}
+
+/**
+ * Copy a frame into the ring, pushing out the oldest frames to make room
+ * @param preroll the ring
+ * @param frame the frame to keep, still owned by the caller
+ * @return 0 if the frame was stored or -1 if it was dropped
+ */
+int PreRoll_store(PREROLL * preroll, FRAME * frame)
+{
+	if(preroll == NULL || frame == NULL) { return -1; }
+
+	pthread_mutex_lock(&preroll->lock);
+
+	// Spliced frames stay in the ring until the clip has written them
+	if(preroll->draining)
+	{
+		if(FramePool_available(preroll->descriptors) < preroll->max_frames)
+		{
+			preroll->stats.dropped++;
+			pthread_mutex_unlock(&preroll->lock);
+			return -1;
+		}
+
+		preroll->draining = false;
+		preroll->head	  = 0;
+	}
+
+	if(preroll->count == preroll->max_frames) { evictOldest(preroll); }
+
+	if(reserveSpace(preroll, frame->size) < 0)
+	{
+		preroll->stats.dropped++;
+		pthread_mutex_unlock(&preroll->lock);
+		return -1;
+	}
+
+	FRAME * stored = FramePool_acquire(preroll->descriptors);
+
+	stored->data		 = preroll->arena + preroll->head;
+	stored->size		 = frame->size;
+	stored->capacity	 = frame->size;
+	stored->width		 = frame->width;
+	stored->height		 = frame->height;
+	stored->sequence	 = frame->sequence;
+	stored->timestamp_us = frame->timestamp_us;
+	memcpy(stored->data, frame->data, frame->size);
+
+	preroll->frames[(preroll->first + preroll->count) % preroll->max_frames] = stored;
+	preroll->count++;
+	preroll->head += frame->size;
+	preroll->bytes += frame->size;
+	preroll->stats.stored++;
+
+	pthread_mutex_unlock(&preroll->lock);
+	return 0;
+}
+
+/**
+ * Move every frame in the ring onto a clip, oldest first. The clip writes them straight out of the
+ * ring, which refills once those writes finish.
+ * @param preroll the ring
+ * @param clip the clip to start with the pre-roll
+ * @return the number of frames spliced
+ */
+int PreRoll_splice(PREROLL * preroll, CLIP * clip)
+{
+	int spliced = 0;
+
+	if(preroll == NULL) { return 0; }
+
+	pthread_mutex_lock(&preroll->lock);
+
+	while(preroll->count > 0)
+	{
+		FRAME * frame = preroll->frames[preroll->first];
+
+		if(Clip_append(clip, frame) == 0) { spliced++; }
+
+		preroll->bytes -= frame->size;
+		preroll->first = (preroll->first + 1) % preroll->max_frames;
+		preroll->count--;
+		FramePool_release(frame);
+	}
+
+	preroll->first	  = 0;
+	preroll->draining = true;
+	preroll->stats.spliced += spliced;
+
+	pthread_mutex_unlock(&preroll->lock);
+
+	DEBUG_PRINTLN("Spliced %d pre-roll frames", spliced);
+	return spliced;
+}
+
+/**
+ * Get what the ring holds and how it has been used
+ * @param preroll the ring
+ * @param[out] stats filled with the ring statistics
+ */
+void PreRoll_get_stats(PREROLL * preroll, PREROLL_STATS * stats)
+{
+	memset(stats, 0, sizeof(PREROLL_STATS));
+
+	if(preroll == NULL) { return; }
+
+	pthread_mutex_lock(&preroll->lock);
+
+	*stats		  = preroll->stats;
+	stats->frames = preroll->count;
+	stats->bytes  = preroll->bytes;
+
+	if(preroll->count > 1)
+	{
+		unsigned int last	= (preroll->first + preroll->count - 1) % preroll->max_frames;
+		FRAME *		 oldest = preroll->frames[preroll->first];
+		FRAME *		 newest = preroll->frames[last];
+
+		stats->duration_us = newest->timestamp_us - oldest->timestamp_us;
+	}
+
+	pthread_mutex_unlock(&preroll->lock);
+}
+
+/**
+ * Move the ring head to a free run of bytes for the next frame, evicting the oldest frames in the
+ * way. A frame never wraps around the end of the ring, so it can be written out in one piece.
+ * @param preroll the ring
+ * @param size the frame size
+ * @return 0 once preroll->head has room or -1 if the frame is larger than the ring
+ */
+static int reserveSpace(PREROLL * preroll, unsigned int size)
+{
+	if(size > preroll->budget) { return -1; }
+
+	while(preroll->count > 0)
+	{
+		unsigned int last	 = (preroll->first + preroll->count - 1) % preroll->max_frames;
+		FRAME *		 newest	 = preroll->frames[last];
+		unsigned int tail	 = preroll->frames[preroll->first]->data - preroll->arena;
+		bool		 wrapped = (unsigned int) (newest->data - preroll->arena) < tail;
+
+		if(wrapped && tail - preroll->head >= size) { return 0; }
+
+		if(!wrapped)
+		{
+			if(preroll->budget - preroll->head >= size) { return 0; }
+
+			if(tail >= size)
+			{
+				preroll->head = 0;
+				return 0;
+			}
+		}
+
+		evictOldest(preroll);
+	}
+
+	preroll->head = 0;
+	return 0;
+}
+
+/**
+ * Drop the oldest frame in the ring
+ * @param preroll the ring
+ */
+static void evictOldest(PREROLL * preroll)
+{
+	FRAME * frame = preroll->frames[preroll->first];
+
+	preroll->bytes -= frame->size;
+	preroll->first = (preroll->first + 1) % preroll->max_frames;
+	preroll->count--;
+	preroll->stats.evicted++;
+	FramePool_release(frame);
+}
@@ -0,0 +1,56 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2021 Lena Voytek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Pre-Roll
+ *
+ * This module keeps the most recent frames captured between visitors in a fixed block of memory,
+ * so an event clip can start with the approach that came before the press
+ */
+
+#ifndef PREROLL_H
+#define PREROLL_H
+
+#include "FramePool.h"
+#include "Clip.h"
+
+typedef struct PREROLL PREROLL;
+
+typedef struct
+{
+	unsigned int	   frames;
+	unsigned int	   bytes;
+	unsigned long long duration_us;
+	unsigned long	   stored;
+	unsigned long	   evicted;
+	unsigned long	   dropped;
+	unsigned long	   spliced;
+} PREROLL_STATS;
+
+PREROLL * PreRoll_create(unsigned int budget_bytes, unsigned int max_frames);
+void	  PreRoll_destroy(PREROLL * preroll);
+
+int	 PreRoll_store(PREROLL * preroll, FRAME * frame);
+int	 PreRoll_splice(PREROLL * preroll, CLIP * clip);
+void PreRoll_get_stats(PREROLL * preroll, PREROLL_STATS * stats);
+
+#endif
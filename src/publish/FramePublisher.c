@@ -0,0 +1,339 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2021 Lena Voytek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Frame Publisher
+ *
+ * This module publishes the latest frame so readers never see a partly written one, as a file
+ * replaced atomically with rename() and as a shared memory segment guarded by a seqlock
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+
+#include "Debug.h"
+#include "FrameWriter.h"
+
+#include "FramePublisher.h"
+
+#define FRAME_SHARED_MAGIC		 0x46524d31	   // "FRM1"
+#define FRAME_SHARED_READ_TRIES	 100
+#define FRAME_PUBLISHER_NAME_MAX 256
+
+// Shared memory layout, the sequence is odd while a frame is being copied in
+struct FRAME_SHARED
+{
+	unsigned int	   magic;
+	unsigned int	   capacity;
+	unsigned int	   sequence;
+	unsigned int	   size;
+	unsigned int	   width;
+	unsigned int	   height;
+	unsigned long	   frame_sequence;
+	unsigned long long timestamp_us;
+	unsigned char	   data[];
+};
+
+static pthread_mutex_t		 publisher_lock = PTHREAD_MUTEX_INITIALIZER;
+static char					 publish_filename[FRAME_PUBLISHER_NAME_MAX];
+static char					 temp_filename[FRAME_PUBLISHER_NAME_MAX + 4];
+static int					 temp_file	  = -1;
+static bool					 file_writing = false;
+static char					 shared_name_copy[FRAME_PUBLISHER_NAME_MAX];
+static FRAME_SHARED *		 shared_frame = NULL;
+static size_t				 shared_size;
+static FRAME_PUBLISHER_STATS publisher_stats;
+
+static void tempFileWritten(FRAME * frame, int fd, int result, void * context);
+static void publishShared(FRAME * frame);
+
+/**
+ * Set up the latest frame outputs. File publishing needs FrameWriter_init() to have been called.
+ * @param filename the file readers open for the latest frame, or NULL for no file
+ * @param shared_name the shared memory name, starting with a slash, or NULL for no segment
+ * @param capacity the largest frame in bytes the shared memory segment holds
+ * @return 0 on success or -1 if an output could not be created
+ */
+int FramePublisher_init(const char * filename, const char * shared_name, unsigned int capacity)
+{
+	FramePublisher_shutdown();
+	memset(&publisher_stats, 0, sizeof(publisher_stats));
+
+	if(filename != NULL)
+	{
+		snprintf(publish_filename, sizeof(publish_filename), "%s", filename);
+		snprintf(temp_filename, sizeof(temp_filename), "%s.tmp", filename);
+
+		// The temporary file sits next to the published one so rename() stays atomic
+		unlink(temp_filename);
+		temp_file = FrameWriter_open(temp_filename);
+
+		if(temp_file < 0) { return -1; }
+	}
+
+	if(shared_name != NULL)
+	{
+		int fd = shm_open(shared_name, O_RDWR | O_CREAT, 0644);
+		shared_size = sizeof(FRAME_SHARED) + capacity;
+
+		if(fd < 0 || ftruncate(fd, shared_size) < 0)
+		{
+			ERROR_PRINTLN("Unable to create shared memory %50s: return %d", shared_name, errno);
+			if(fd >= 0) { close(fd); }
+			FramePublisher_shutdown();
+			return -1;
+		}
+
+		shared_frame = mmap(NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+
+		if(shared_frame == MAP_FAILED)
+		{
+			ERROR_PRINTLN("Unable to map shared memory %50s: return %d", shared_name, errno);
+			shared_frame = NULL;
+			FramePublisher_shutdown();
+			return -1;
+		}
+
+		snprintf(shared_name_copy, sizeof(shared_name_copy), "%s", shared_name);
+		memset(shared_frame, 0, sizeof(FRAME_SHARED));
+		shared_frame->capacity = capacity;
+		__atomic_store_n(&shared_frame->magic, FRAME_SHARED_MAGIC, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+/**
+ * Publish a frame as the latest one. The shared memory copy is updated straight away. The file is
+ * written to a temporary file in the background and renamed over the published file, and is
+ * skipped if the previous frame is still being written.
+ * @param frame the frame to publish
+ * @return 0 if every output took the frame or -1 if one skipped it
+ */
+int FramePublisher_publish(FRAME * frame)
+{
+	int result = 0;
+
+	pthread_mutex_lock(&publisher_lock);
+
+	if(shared_frame != NULL)
+	{
+		if(frame->size <= shared_frame->capacity) { publishShared(frame); }
+		else
+		{
+			publisher_stats.shared_skipped++;
+			result = -1;
+		}
+	}
+
+	if(temp_file >= 0)
+	{
+		if(!file_writing && FrameWriter_write(temp_file, frame, 0, tempFileWritten, NULL) == 0)
+		{
+			file_writing = true;
+		}
+		else
+		{
+			publisher_stats.file_skipped++;
+			result = -1;
+		}
+	}
+
+	pthread_mutex_unlock(&publisher_lock);
+	return result;
+}
+
+/**
+ * Get the number of frames each output has published and skipped
+ * @param[out] stats the publisher statistics since it was set up
+ */
+void FramePublisher_get_stats(FRAME_PUBLISHER_STATS * stats)
+{
+	pthread_mutex_lock(&publisher_lock);
+	*stats = publisher_stats;
+	pthread_mutex_unlock(&publisher_lock);
+}
+
+/**
+ * Remove the temporary file and the shared memory segment. Call after FrameWriter_shutdown() so
+ * no file write is still in flight.
+ */
+void FramePublisher_shutdown()
+{
+	pthread_mutex_lock(&publisher_lock);
+
+	if(temp_file >= 0)
+	{
+		FrameWriter_close(temp_file);
+		unlink(temp_filename);
+		temp_file = -1;
+	}
+
+	file_writing = false;
+
+	if(shared_frame != NULL)
+	{
+		munmap(shared_frame, shared_size);
+		shm_unlink(shared_name_copy);
+		shared_frame = NULL;
+	}
+
+	pthread_mutex_unlock(&publisher_lock);
+}
+
+/**
+ * Map another process's latest frame segment for reading
+ * @param shared_name the shared memory name the publisher was set up with
+ * @return the segment, or NULL if it does not exist
+ */
+FRAME_SHARED * FramePublisher_attach(const char * shared_name)
+{
+	int fd = shm_open(shared_name, O_RDONLY, 0);
+	if(fd < 0) { return NULL; }
+
+	FRAME_SHARED header;
+	FRAME_SHARED * shared = NULL;
+
+	if(read(fd, &header, sizeof(header)) == sizeof(header) && header.magic == FRAME_SHARED_MAGIC)
+	{
+		shared = mmap(NULL, sizeof(FRAME_SHARED) + header.capacity, PROT_READ, MAP_SHARED, fd, 0);
+		if(shared == MAP_FAILED) { shared = NULL; }
+	}
+
+	close(fd);
+	return shared;
+}
+
+/**
+ * Copy the latest frame out of a shared segment, retrying while the publisher is mid-update
+ * @param shared the segment from FramePublisher_attach()
+ * @param[out] buffer the buffer to copy the frame into
+ * @param capacity the buffer size in bytes
+ * @param[out] info the frame size, dimensions, sequence and timestamp, data is left untouched
+ * @return the frame size in bytes, 0 if nothing is published yet, or -1 on failure
+ */
+int FramePublisher_read(FRAME_SHARED * shared,
+						unsigned char * buffer,
+						unsigned int	capacity,
+						FRAME *			info)
+{
+	for(int attempt = 0; attempt < FRAME_SHARED_READ_TRIES; attempt++)
+	{
+		unsigned int sequence = __atomic_load_n(&shared->sequence, __ATOMIC_ACQUIRE);
+
+		if(sequence & 1)
+		{
+			sched_yield();
+			continue;
+		}
+
+		unsigned int size = shared->size;
+		if(size > capacity || size > shared->capacity) { return -1; }
+
+		memcpy(buffer, shared->data, size);
+		info->size			= size;
+		info->width			= shared->width;
+		info->height		= shared->height;
+		info->sequence		= shared->frame_sequence;
+		info->timestamp_us	= shared->timestamp_us;
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&shared->sequence, __ATOMIC_RELAXED) == sequence) { return size; }
+	}
+
+	return -1;
+}
+
+/**
+ * Unmap a segment from FramePublisher_attach()
+ * @param shared the segment, may be NULL
+ */
+void FramePublisher_detach(FRAME_SHARED * shared)
+{
+	if(shared != NULL) { munmap(shared, sizeof(FRAME_SHARED) + shared->capacity); }
+}
+
+/**
+ * Frame writer callback that replaces the published file with the temporary file just written,
+ * then starts a new temporary file for the next frame
+ * @param frame the frame written
+ * @param fd the temporary file descriptor
+ * @param result the number of bytes written, or a negative errno on failure
+ * @param context Unused
+ */
+static void tempFileWritten(FRAME * frame, int fd, int result, void * context)
+{
+	bool published = result >= 0 && ftruncate(fd, frame->size) == 0 &&
+					 rename(temp_filename, publish_filename) == 0;
+
+	pthread_mutex_lock(&publisher_lock);
+
+	if(published)
+	{
+		publisher_stats.file_published++;
+
+		FrameWriter_close(temp_file);
+		temp_file = FrameWriter_open(temp_filename);
+	}
+	else
+	{
+		ERROR_PRINTLN("Failed to publish %50s: return %d",
+					  publish_filename,
+					  result < 0 ? -result : errno);
+		publisher_stats.file_failed++;
+	}
+
+	file_writing = false;
+	pthread_mutex_unlock(&publisher_lock);
+}
+
+/**
+ * Copy a frame into the shared memory segment under the seqlock, called with publisher_lock held
+ * @param frame the frame to copy
+ */
+static void publishShared(FRAME * frame)
+{
+	unsigned int sequence = shared_frame->sequence;
+
+	// An odd sequence tells readers to retry, and the fence keeps the frame writes after it
+	__atomic_store_n(&shared_frame->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memcpy(shared_frame->data, frame->data, frame->size);
+	shared_frame->size			 = frame->size;
+	shared_frame->width			 = frame->width;
+	shared_frame->height		 = frame->height;
+	shared_frame->frame_sequence = frame->sequence;
+	shared_frame->timestamp_us	 = frame->timestamp_us;
+
+	__atomic_store_n(&shared_frame->sequence, sequence + 2, __ATOMIC_RELEASE);
+	publisher_stats.shared_published++;
+}
@@ -0,0 +1,58 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2021 Lena Voytek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Frame Publisher
+ *
+ * This module publishes the latest frame so readers never see a partly written one, as a file
+ * replaced atomically with rename() and as a shared memory segment guarded by a seqlock
+ */
+
+#ifndef FRAME_PUBLISHER_H
+#define FRAME_PUBLISHER_H
+
+#include "FramePool.h"
+
+typedef struct FRAME_SHARED FRAME_SHARED;
+
+typedef struct
+{
+	unsigned long file_published;
+	unsigned long file_skipped;
+	unsigned long file_failed;
+	unsigned long shared_published;
+	unsigned long shared_skipped;
+} FRAME_PUBLISHER_STATS;
+
+int	 FramePublisher_init(const char * filename, const char * shared_name, unsigned int capacity);
+int	 FramePublisher_publish(FRAME * frame);
+void FramePublisher_get_stats(FRAME_PUBLISHER_STATS * stats);
+void FramePublisher_shutdown();
+
+FRAME_SHARED * FramePublisher_attach(const char * shared_name);
+int			   FramePublisher_read(FRAME_SHARED * shared,
+								   unsigned char * buffer,
+								   unsigned int	   capacity,
+								   FRAME *		   info);
+void		   FramePublisher_detach(FRAME_SHARED * shared);
+
+#endif
@@ -0,0 +1,951 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2021 Lena Voytek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Frame Writer
+ *
+ * This module writes frames to storage asynchronously through io_uring, or a small pool of
+ * writer threads where io_uring is unavailable, so capture never waits on a slow card
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "Debug.h"
+#include "Timer.h"
+
+#include "FrameWriter.h"
+
+#define FRAME_WRITER_THREADS 2
+
+typedef struct
+{
+	FRAME *			   frame;
+	unsigned char	   prefix[FRAME_WRITER_PREFIX_MAX];
+	unsigned int	   prefix_size;
+	struct iovec	   iov[2];
+	int				   file;
+	unsigned long long offset;
+	unsigned int	   written;
+	bool			   fixed_buffer;
+	FRAME_WRITE_DONE   done;
+	void *			   context;
+	unsigned long long submit_us;
+} WRITE_REQUEST;
+
+// Request slots, shared by both engines under writer_lock
+static pthread_mutex_t	  writer_lock	 = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	  writer_cond	 = PTHREAD_COND_INITIALIZER;
+static bool				  writer_running = false;
+static WRITE_REQUEST *	  requests		 = NULL;
+static unsigned int *	  free_requests	 = NULL;
+static unsigned int		  free_request_count;
+static unsigned int		  request_count;
+static int				  file_fds[FRAME_WRITER_MAX_FILES];
+static FRAME_WRITER_STATS writer_stats;
+static unsigned long long latency_total_us;
+
+// io_uring engine, set up with raw system calls so no extra library is needed
+static int					 ring_fd = -1;
+static void *				 sq_ring_map;
+static void *				 cq_ring_map;
+static size_t				 sq_ring_size;
+static size_t				 cq_ring_size;
+static struct io_uring_sqe * sqes;
+static size_t				 sqes_size;
+static unsigned int *		 sq_head;
+static unsigned int *		 sq_tail;
+static unsigned int *		 sq_mask;
+static unsigned int *		 sq_array;
+static unsigned int *		 cq_head;
+static unsigned int *		 cq_tail;
+static unsigned int *		 cq_mask;
+static struct io_uring_cqe * cqes;
+static unsigned int			 sq_unsubmitted;
+static bool					 files_registered;
+static unsigned long		 registered_pool_id;
+static unsigned long		 unregisterable_pool_id;
+static pthread_t			 completion_thread;
+
+// Thread pool engine
+static unsigned int * pending_requests = NULL;
+static unsigned int	  pending_head;
+static unsigned int	  pending_count;
+static pthread_t	  writer_threads[FRAME_WRITER_THREADS];
+
+// Deferred jobs, run by one thread of their own so neither engine blocks on them
+static FRAME_WRITER_JOB jobs[FRAME_WRITER_MAX_JOBS];
+static void *			job_contexts[FRAME_WRITER_MAX_JOBS];
+static unsigned int		job_head;
+static unsigned int		job_count;
+static bool				jobs_running = false;
+static pthread_t		job_thread;
+
+static int	  openFile(const char * filename, int flags);
+static bool	  setupRing(unsigned int queue_depth);
+static bool	  ringSupportsWrites();
+static void	  teardownRing();
+static bool	  useFixedBuffer(FRAME * frame);
+static void	  submitRequest(unsigned int index);
+static int	  flushSubmissions();
+static void * completionThread(void * arg);
+static void * writerThread(void * arg);
+static void * jobThread(void * arg);
+static void	  finishRequest(unsigned int index, int result);
+static int	  requestIovecs(WRITE_REQUEST * request);
+
+/**
+ * Start the writer, preferring io_uring and falling back to writer threads
+ * @param queue_depth the most writes that may be in flight at once
+ * @return 0 on success or -1 on failure
+ */
+int FrameWriter_init(unsigned int queue_depth)
+{
+	FrameWriter_shutdown();
+
+	requests		 = calloc(queue_depth, sizeof(WRITE_REQUEST));
+	free_requests	 = calloc(queue_depth, sizeof(unsigned int));
+	pending_requests = calloc(queue_depth, sizeof(unsigned int));
+
+	if(queue_depth == 0 || requests == NULL || free_requests == NULL || pending_requests == NULL)
+	{
+		ERROR_PRINTLN("Unable to allocate %u frame write requests", queue_depth);
+		FrameWriter_shutdown();
+		return -1;
+	}
+
+	for(unsigned int i = 0; i < queue_depth; i++) { free_requests[i] = queue_depth - 1 - i; }
+	for(int i = 0; i < FRAME_WRITER_MAX_FILES; i++) { file_fds[i] = -1; }
+
+	request_count	   = queue_depth;
+	free_request_count = queue_depth;
+	pending_head	   = 0;
+	pending_count	   = 0;
+	job_head		   = 0;
+	job_count		   = 0;
+	latency_total_us   = 0;
+	memset(&writer_stats, 0, sizeof(writer_stats));
+
+	writer_running = true;
+	jobs_running   = true;
+	pthread_create(&job_thread, NULL, jobThread, NULL);
+
+	if(setupRing(queue_depth))
+	{
+		writer_stats.io_uring = true;
+		pthread_create(&completion_thread, NULL, completionThread, NULL);
+		DEBUG_PRINTLN("Frame writer using io_uring, %u writes deep", queue_depth);
+	}
+	else
+	{
+		for(int i = 0; i < FRAME_WRITER_THREADS; i++)
+		{
+			pthread_create(&writer_threads[i], NULL, writerThread, NULL);
+		}
+
+		DEBUG_PRINTLN("Frame writer using %d threads, %u writes deep",
+					  FRAME_WRITER_THREADS,
+					  queue_depth);
+	}
+
+	return 0;
+}
+
+/**
+ * Wait for every queued job and write to finish, then stop the writer and close its files
+ */
+void FrameWriter_shutdown()
+{
+	pthread_mutex_lock(&writer_lock);
+	bool running = writer_running;
+	jobs_running = false;
+	pthread_cond_broadcast(&writer_cond);
+	pthread_mutex_unlock(&writer_lock);
+
+	// Jobs may queue writes or wait on them, so they finish before either engine stops
+	if(running) { pthread_join(job_thread, NULL); }
+
+	pthread_mutex_lock(&writer_lock);
+	writer_running = false;
+
+	if(running && writer_stats.io_uring)
+	{
+		while(writer_stats.queue_depth > 0)
+		{
+			// A write the kernel turned away has no later write to carry it, so it is retried here
+			if(flushSubmissions() > 0)
+			{
+				pthread_mutex_unlock(&writer_lock);
+				Timer_delay_ms(1);
+				pthread_mutex_lock(&writer_lock);
+			}
+			else
+			{
+				pthread_cond_wait(&writer_cond, &writer_lock);
+			}
+		}
+
+		// A no-op with no request attached wakes the completion thread to exit
+		struct io_uring_sqe * sqe = &sqes[*sq_tail & *sq_mask];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_NOP;
+
+		sq_array[*sq_tail & *sq_mask] = *sq_tail & *sq_mask;
+		__atomic_store_n(sq_tail, *sq_tail + 1, __ATOMIC_RELEASE);
+		sq_unsubmitted++;
+
+		flushSubmissions();
+	}
+
+	pthread_cond_broadcast(&writer_cond);
+	pthread_mutex_unlock(&writer_lock);
+
+	if(running)
+	{
+		if(writer_stats.io_uring) { pthread_join(completion_thread, NULL); }
+		else
+		{
+			for(int i = 0; i < FRAME_WRITER_THREADS; i++) { pthread_join(writer_threads[i], NULL); }
+		}
+
+		for(int i = 0; i < FRAME_WRITER_MAX_FILES; i++) { FrameWriter_close(i); }
+	}
+
+	teardownRing();
+
+	free(requests);
+	free(free_requests);
+	free(pending_requests);
+	requests		 = NULL;
+	free_requests	 = NULL;
+	pending_requests = NULL;
+}
+
+/**
+ * Open a file for frame writes, creating it if needed. Existing contents are kept so callers
+ * choose the write offsets.
+ * @param filename the file to open
+ * @return the writer file number, or -1 on failure
+ */
+int FrameWriter_open(const char * filename)
+{
+	return openFile(filename, O_WRONLY | O_CREAT | O_CLOEXEC);
+}
+
+/**
+ * Create a new file for frame writes, never replacing one that already exists
+ * @param filename the file to create
+ * @return the writer file number, or -1 on failure with errno set to EEXIST if the file exists
+ */
+int FrameWriter_create(const char * filename)
+{
+	return openFile(filename, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC);
+}
+
+/**
+ * Queue slow file work to run after the jobs already queued, without waiting for it
+ * @param job the work to run
+ * @param context passed to job
+ * @return 0 if the job was queued or -1 if the job queue is full or the writer is stopped
+ */
+int FrameWriter_defer(FRAME_WRITER_JOB job, void * context)
+{
+	pthread_mutex_lock(&writer_lock);
+
+	if(!jobs_running || job_count == FRAME_WRITER_MAX_JOBS)
+	{
+		pthread_mutex_unlock(&writer_lock);
+		return -1;
+	}
+
+	unsigned int slot  = (job_head + job_count) % FRAME_WRITER_MAX_JOBS;
+	jobs[slot]		   = job;
+	job_contexts[slot] = context;
+	job_count++;
+
+	pthread_cond_broadcast(&writer_cond);
+	pthread_mutex_unlock(&writer_lock);
+	return 0;
+}
+
+/**
+ * Get the descriptor behind a writer file, for metadata calls such as fallocate() and fsync()
+ * @param file the writer file number
+ * @return the file descriptor, or -1 if the file is not open
+ */
+int FrameWriter_get_fd(int file)
+{
+	if(file < 0 || file >= FRAME_WRITER_MAX_FILES) { return -1; }
+	return file_fds[file];
+}
+
+/**
+ * Close a file opened with FrameWriter_open(), which must have no writes in flight
+ * @param file the writer file number
+ */
+void FrameWriter_close(int file)
+{
+	if(file < 0 || file >= FRAME_WRITER_MAX_FILES) { return; }
+
+	pthread_mutex_lock(&writer_lock);
+
+	if(file_fds[file] >= 0)
+	{
+		if(files_registered)
+		{
+			int							 unused = -1;
+			struct io_uring_files_update update = {.offset = file, .fds = (unsigned long) &unused};
+			syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+		}
+
+		close(file_fds[file]);
+		file_fds[file] = -1;
+	}
+
+	pthread_mutex_unlock(&writer_lock);
+}
+
+/**
+ * Queue a frame write without waiting for it. The writer holds its own reference to the frame
+ * until the write finishes, so the caller may release the frame straight away.
+ * @param file the writer file number
+ * @param frame the frame to write
+ * @param offset the file offset to write the frame at
+ * @param done called once the write finishes, may be NULL
+ * @param context passed to done
+ * @return 0 if the write was queued or -1 if the queue is full or the writer is stopped
+ */
+int FrameWriter_write(int				 file,
+					  FRAME *			 frame,
+					  unsigned long long offset,
+					  FRAME_WRITE_DONE	 done,
+					  void *			 context)
+{
+	return FrameWriter_write_record(file, NULL, 0, frame, offset, done, context);
+}
+
+/**
+ * Queue a write of a small record header followed by a frame, as one write. The header is copied,
+ * so it may live on the caller's stack.
+ * @param file the writer file number
+ * @param prefix the bytes to write ahead of the frame
+ * @param prefix_size the number of prefix bytes, at most FRAME_WRITER_PREFIX_MAX
+ * @param frame the frame to write after the prefix
+ * @param offset the file offset to write the prefix at
+ * @param done called once the write finishes, may be NULL
+ * @param context passed to done
+ * @return 0 if the write was queued or -1 if the queue is full or the writer is stopped
+ */
+int FrameWriter_write_record(int				file,
+							 const void *		prefix,
+							 unsigned int		prefix_size,
+							 FRAME *			frame,
+							 unsigned long long offset,
+							 FRAME_WRITE_DONE	done,
+							 void *				context)
+{
+	if(prefix_size > FRAME_WRITER_PREFIX_MAX) { return -1; }
+
+	pthread_mutex_lock(&writer_lock);
+
+	if(!writer_running || free_request_count == 0 || file < 0 || file >= FRAME_WRITER_MAX_FILES ||
+	   file_fds[file] < 0)
+	{
+		writer_stats.rejected++;
+		pthread_mutex_unlock(&writer_lock);
+		return -1;
+	}
+
+	unsigned int	index	= free_requests[--free_request_count];
+	WRITE_REQUEST * request = &requests[index];
+
+	if(prefix_size > 0) { memcpy(request->prefix, prefix, prefix_size); }
+
+	request->prefix_size  = prefix_size;
+	request->frame		  = FramePool_retain(frame);
+	request->file		  = file;
+	request->offset		  = offset;
+	request->written	  = 0;
+	request->fixed_buffer = writer_stats.io_uring && prefix_size == 0 && useFixedBuffer(frame);
+	request->done		  = done;
+	request->context	  = context;
+	request->submit_us	  = Timer_now_us();
+
+	writer_stats.submitted++;
+	writer_stats.queue_depth++;
+
+	if(writer_stats.queue_depth > writer_stats.max_queue_depth)
+	{
+		writer_stats.max_queue_depth = writer_stats.queue_depth;
+	}
+
+	if(writer_stats.io_uring) { submitRequest(index); }
+	else
+	{
+		pending_requests[(pending_head + pending_count) % request_count] = index;
+		pending_count++;
+		pthread_cond_broadcast(&writer_cond);
+	}
+
+	pthread_mutex_unlock(&writer_lock);
+	return 0;
+}
+
+/**
+ * Get the writer queue depth, write latency and counters
+ * @param[out] stats the writer statistics since it was started
+ */
+void FrameWriter_get_stats(FRAME_WRITER_STATS * stats)
+{
+	pthread_mutex_lock(&writer_lock);
+
+	unsigned long finished = writer_stats.completed + writer_stats.failed;
+	writer_stats.average_latency_us = finished > 0 ? latency_total_us / finished : 0;
+	*stats							= writer_stats;
+
+	pthread_mutex_unlock(&writer_lock);
+}
+
+/**
+ * Open a file and give it a writer file number, registering it with io_uring when in use
+ * @param filename the file to open
+ * @param flags the open() flags
+ * @return the writer file number, or -1 on failure with errno set by open()
+ */
+static int openFile(const char * filename, int flags)
+{
+	int fd = open(filename, flags, 0644);
+
+	if(fd < 0)
+	{
+		int error = errno;
+
+		if(error != EEXIST) { ERROR_PRINTLN("Failed to open %50s: return %d", filename, error); }
+
+		errno = error;
+		return -1;
+	}
+
+	pthread_mutex_lock(&writer_lock);
+
+	int file = 0;
+	while(file < FRAME_WRITER_MAX_FILES && file_fds[file] >= 0) { file++; }
+
+	if(file < FRAME_WRITER_MAX_FILES && files_registered)
+	{
+		struct io_uring_files_update update = {.offset = file, .fds = (unsigned long) &fd};
+
+		if(syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_FILES_UPDATE, &update, 1) < 0)
+		{
+			ERROR_PRINTLN("Unable to register %50s with io_uring: return %d", filename, errno);
+			file = FRAME_WRITER_MAX_FILES;
+		}
+	}
+
+	if(file < FRAME_WRITER_MAX_FILES) { file_fds[file] = fd; }
+	pthread_mutex_unlock(&writer_lock);
+
+	if(file == FRAME_WRITER_MAX_FILES)
+	{
+		ERROR_PRINTLN("No free frame writer file for %50s", filename);
+		close(fd);
+		errno = EMFILE;
+		return -1;
+	}
+
+	return file;
+}
+
+/**
+ * Create the io_uring instance, map its rings and register an empty file table
+ * @param queue_depth the most writes that may be in flight at once
+ * @return true if io_uring is ready to use
+ */
+static bool setupRing(unsigned int queue_depth)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	// One extra entry for the no-op that stops the completion thread
+	ring_fd = syscall(__NR_io_uring_setup, queue_depth + 1, &params);
+
+	if(ring_fd < 0)
+	{
+		DEBUG_PRINTLN("io_uring unavailable: return %d", errno);
+		return false;
+	}
+
+	if(!ringSupportsWrites())
+	{
+		teardownRing();
+		return false;
+	}
+
+	sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	sqes_size	 = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	if(params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if(cq_ring_size > sq_ring_size) { sq_ring_size = cq_ring_size; }
+		cq_ring_size = sq_ring_size;
+	}
+
+	sq_ring_map = mmap(NULL,
+					   sq_ring_size,
+					   PROT_READ | PROT_WRITE,
+					   MAP_SHARED | MAP_POPULATE,
+					   ring_fd,
+					   IORING_OFF_SQ_RING);
+
+	cq_ring_map = (params.features & IORING_FEAT_SINGLE_MMAP) ?
+					  sq_ring_map :
+					  mmap(NULL,
+						   cq_ring_size,
+						   PROT_READ | PROT_WRITE,
+						   MAP_SHARED | MAP_POPULATE,
+						   ring_fd,
+						   IORING_OFF_CQ_RING);
+
+	sqes = mmap(NULL,
+				sqes_size,
+				PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE,
+				ring_fd,
+				IORING_OFF_SQES);
+
+	if(sq_ring_map == MAP_FAILED || cq_ring_map == MAP_FAILED || sqes == MAP_FAILED)
+	{
+		ERROR_PRINTLN("Unable to map the io_uring rings: return %d", errno);
+		teardownRing();
+		return false;
+	}
+
+	sq_head	 = (unsigned int *) ((char *) sq_ring_map + params.sq_off.head);
+	sq_tail	 = (unsigned int *) ((char *) sq_ring_map + params.sq_off.tail);
+	sq_mask	 = (unsigned int *) ((char *) sq_ring_map + params.sq_off.ring_mask);
+	sq_array = (unsigned int *) ((char *) sq_ring_map + params.sq_off.array);
+	cq_head	 = (unsigned int *) ((char *) cq_ring_map + params.cq_off.head);
+	cq_tail	 = (unsigned int *) ((char *) cq_ring_map + params.cq_off.tail);
+	cq_mask	 = (unsigned int *) ((char *) cq_ring_map + params.cq_off.ring_mask);
+	cqes	 = (struct io_uring_cqe *) ((char *) cq_ring_map + params.cq_off.cqes);
+
+	sq_unsubmitted		   = 0;
+	registered_pool_id	   = 0;
+	unregisterable_pool_id = 0;
+
+	// A sparse table lets files be registered as they are opened, without a descriptor lookup
+	// on every write
+	int empty_files[FRAME_WRITER_MAX_FILES];
+	for(int i = 0; i < FRAME_WRITER_MAX_FILES; i++) { empty_files[i] = -1; }
+
+	files_registered = syscall(__NR_io_uring_register,
+							   ring_fd,
+							   IORING_REGISTER_FILES,
+							   empty_files,
+							   FRAME_WRITER_MAX_FILES) == 0;
+
+	if(!files_registered) { DEBUG_PRINTLN("io_uring file registration unavailable: %d", errno); }
+
+	return true;
+}
+
+/**
+ * Check that the kernel's io_uring has the write opcodes. Rings date from Linux 5.1, but plain
+ * and vectored writes only arrived in 5.6 along with the probe itself.
+ * @return true if IORING_OP_WRITE and IORING_OP_WRITEV are both supported
+ */
+static bool ringSupportsWrites()
+{
+	size_t					ops_size = IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe * probe	 = calloc(1, sizeof(struct io_uring_probe) + ops_size);
+
+	if(probe == NULL) { return false; }
+
+	bool supported = false;
+
+	if(syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0)
+	{
+		DEBUG_PRINTLN("io_uring probe unavailable: return %d", errno);
+	}
+	else
+	{
+		supported = probe->last_op >= IORING_OP_WRITE &&
+					(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED) &&
+					(probe->ops[IORING_OP_WRITEV].flags & IO_URING_OP_SUPPORTED);
+
+		if(!supported) { DEBUG_PRINTLN("io_uring lacks write support"); }
+	}
+
+	free(probe);
+	return supported;
+}
+
+/**
+ * Unmap the io_uring rings and close the instance
+ */
+static void teardownRing()
+{
+	if(ring_fd < 0) { return; }
+
+	if(sqes != NULL && sqes != MAP_FAILED) { munmap(sqes, sqes_size); }
+
+	if(cq_ring_map != NULL && cq_ring_map != MAP_FAILED && cq_ring_map != sq_ring_map)
+	{
+		munmap(cq_ring_map, cq_ring_size);
+	}
+
+	if(sq_ring_map != NULL && sq_ring_map != MAP_FAILED) { munmap(sq_ring_map, sq_ring_size); }
+
+	close(ring_fd);
+
+	ring_fd			 = -1;
+	sqes			 = NULL;
+	sq_ring_map		 = NULL;
+	cq_ring_map		 = NULL;
+	files_registered = false;
+}
+
+/**
+ * Register the frame's pool with io_uring so its pages are pinned once instead of on every
+ * write. The registration only changes while no write is in flight, called with writer_lock held.
+ * @param frame the frame about to be written
+ * @return true if the frame lies in the registered buffer
+ */
+static bool useFixedBuffer(FRAME * frame)
+{
+	unsigned long pool_id = FramePool_id(frame->pool);
+
+	if(pool_id == registered_pool_id) { return true; }
+	if(pool_id == unregisterable_pool_id || writer_stats.queue_depth > 0) { return false; }
+
+	if(registered_pool_id != 0)
+	{
+		syscall(__NR_io_uring_register, ring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+		registered_pool_id = 0;
+	}
+
+	unsigned long length;
+	struct iovec  pool_buffer;
+	pool_buffer.iov_base = FramePool_storage(frame->pool, &length);
+	pool_buffer.iov_len	 = length;
+
+	if(syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, &pool_buffer, 1) < 0)
+	{
+		DEBUG_PRINTLN("Unable to register frame pool buffers: return %d", errno);
+		unregisterable_pool_id = pool_id;
+		return false;
+	}
+
+	registered_pool_id = pool_id;
+	return true;
+}
+
+/**
+ * Queue the unwritten part of a request on the submission ring, called with writer_lock held
+ * @param index the request slot
+ */
+static void submitRequest(unsigned int index)
+{
+	WRITE_REQUEST *		  request = &requests[index];
+	unsigned int		  tail	  = *sq_tail;
+	struct io_uring_sqe * sqe	  = &sqes[tail & *sq_mask];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd		   = files_registered ? request->file : file_fds[request->file];
+	sqe->flags	   = files_registered ? IOSQE_FIXED_FILE : 0;
+	sqe->off	   = request->offset + request->written;
+	sqe->user_data = index + 1;
+
+	// A record header goes out with its frame as one vectored write
+	if(request->prefix_size > 0)
+	{
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->len	= requestIovecs(request);
+		sqe->addr	= (unsigned long) request->iov;
+	}
+	else
+	{
+		sqe->opcode = request->fixed_buffer ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+		sqe->addr	= (unsigned long) (request->frame->data + request->written);
+		sqe->len	= request->frame->size - request->written;
+	}
+
+	sq_array[tail & *sq_mask] = tail & *sq_mask;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	sq_unsubmitted++;
+
+	flushSubmissions();
+}
+
+/**
+ * Pass the entries queued on the submission ring to the kernel. Entries it cannot take now, for
+ * instance while the completion ring is full, stay queued for the completion thread to retry.
+ * Called with writer_lock held.
+ * @return the number of entries still waiting to be submitted
+ */
+static int flushSubmissions()
+{
+	if(sq_unsubmitted == 0) { return 0; }
+
+	int submitted = syscall(__NR_io_uring_enter, ring_fd, sq_unsubmitted, 0, 0, NULL, 0);
+
+	if(submitted >= 0) { sq_unsubmitted -= submitted; }
+	else if(errno != EAGAIN && errno != EBUSY && errno != EINTR)
+	{
+		ERROR_PRINTLN("io_uring submission failed: return %d", errno);
+	}
+
+	return sq_unsubmitted;
+}
+
+/**
+ * Reap io_uring completions until the writer shuts down
+ * @param arg Unused
+ * @return Unused
+ */
+static void * completionThread(void * arg)
+{
+	bool stopping = false;
+
+	while(!stopping)
+	{
+		// Entries the kernel turned away are retried here, as no later write may come to carry
+		// them. Until they are in, completions are polled rather than waited for.
+		pthread_mutex_lock(&writer_lock);
+		bool backlog = flushSubmissions() > 0;
+		pthread_mutex_unlock(&writer_lock);
+
+		if(backlog) { Timer_delay_ms(1); }
+		else if(syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+				errno != EINTR)
+		{
+			ERROR_PRINTLN("io_uring completion wait failed: return %d", errno);
+			Timer_delay_ms(10);
+		}
+
+		unsigned int head = *cq_head;
+		unsigned int tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+		for(; head != tail; head++)
+		{
+			struct io_uring_cqe * cqe = &cqes[head & *cq_mask];
+
+			if(cqe->user_data == 0)
+			{
+				stopping = true;
+				continue;
+			}
+
+			unsigned int	index	= cqe->user_data - 1;
+			WRITE_REQUEST * request = &requests[index];
+			unsigned int	size	= request->prefix_size + request->frame->size;
+			int				result	= cqe->res;
+
+			// Writing nothing means the device is full or gone, as in the thread writer
+			if(result == 0) { result = -EIO; }
+
+			if(result > 0)
+			{
+				pthread_mutex_lock(&writer_lock);
+				request->written += result;
+
+				// A short write is resubmitted for the rest of the frame
+				if(request->written < size)
+				{
+					submitRequest(index);
+					pthread_mutex_unlock(&writer_lock);
+					continue;
+				}
+
+				pthread_mutex_unlock(&writer_lock);
+				result = request->written;
+			}
+
+			finishRequest(index, result);
+		}
+
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+/**
+ * Write queued requests with blocking writes until the writer shuts down and the queue is empty
+ * @param arg Unused
+ * @return Unused
+ */
+static void * writerThread(void * arg)
+{
+	pthread_mutex_lock(&writer_lock);
+
+	while(writer_running || pending_count > 0)
+	{
+		if(pending_count == 0)
+		{
+			pthread_cond_wait(&writer_cond, &writer_lock);
+			continue;
+		}
+
+		unsigned int index = pending_requests[pending_head];
+		pending_head	   = (pending_head + 1) % request_count;
+		pending_count--;
+
+		pthread_mutex_unlock(&writer_lock);
+
+		WRITE_REQUEST * request = &requests[index];
+		unsigned int	size	= request->prefix_size + request->frame->size;
+		int				result	= 0;
+
+		while(request->written < size)
+		{
+			ssize_t count = pwritev(file_fds[request->file],
+									request->iov,
+									requestIovecs(request),
+									request->offset + request->written);
+
+			if(count < 0 && errno == EINTR) { continue; }
+
+			if(count <= 0)
+			{
+				result = count < 0 ? -errno : -EIO;
+				break;
+			}
+
+			request->written += count;
+		}
+
+		finishRequest(index, result < 0 ? result : (int) request->written);
+
+		pthread_mutex_lock(&writer_lock);
+	}
+
+	pthread_mutex_unlock(&writer_lock);
+	return 0;
+}
+
+/**
+ * Run deferred jobs in order until the writer shuts down and the job queue is empty
+ * @param arg Unused
+ * @return Unused
+ */
+static void * jobThread(void * arg)
+{
+	pthread_mutex_lock(&writer_lock);
+
+	while(jobs_running || job_count > 0)
+	{
+		if(job_count == 0)
+		{
+			pthread_cond_wait(&writer_cond, &writer_lock);
+			continue;
+		}
+
+		FRAME_WRITER_JOB job	 = jobs[job_head];
+		void *			 context = job_contexts[job_head];
+		job_head				 = (job_head + 1) % FRAME_WRITER_MAX_JOBS;
+		job_count--;
+
+		pthread_mutex_unlock(&writer_lock);
+		job(context);
+		pthread_mutex_lock(&writer_lock);
+	}
+
+	pthread_mutex_unlock(&writer_lock);
+	return 0;
+}
+
+/**
+ * Point a request's vectors at its prefix and frame, skipping what is already written
+ * @param request the request
+ * @return the number of vectors used
+ */
+static int requestIovecs(WRITE_REQUEST * request)
+{
+	unsigned int skip  = request->written;
+	int			 count = 0;
+
+	if(skip < request->prefix_size)
+	{
+		request->iov[count].iov_base = request->prefix + skip;
+		request->iov[count].iov_len	 = request->prefix_size - skip;
+		count++;
+		skip = 0;
+	}
+	else
+	{
+		skip -= request->prefix_size;
+	}
+
+	request->iov[count].iov_base = request->frame->data + skip;
+	request->iov[count].iov_len	 = request->frame->size - skip;
+
+	return count + 1;
+}
+
+/**
+ * Report a finished write, release its frame and free its request slot
+ * @param index the request slot
+ * @param result the number of bytes written, or a negative errno on failure
+ */
+static void finishRequest(unsigned int index, int result)
+{
+	WRITE_REQUEST *	   request	  = &requests[index];
+	unsigned long long latency_us = Timer_now_us() - request->submit_us;
+
+	if(result < 0) { ERROR_PRINTLN("Frame write failed: return %d", -result); }
+
+	if(request->done != NULL)
+	{
+		request->done(request->frame, file_fds[request->file], result, request->context);
+	}
+
+	FramePool_release(request->frame);
+
+	pthread_mutex_lock(&writer_lock);
+
+	if(result < 0) { writer_stats.failed++; }
+	else
+	{
+		writer_stats.completed++;
+	}
+
+	writer_stats.last_latency_us = latency_us;
+	latency_total_us += latency_us;
+
+	if(latency_us > writer_stats.max_latency_us) { writer_stats.max_latency_us = latency_us; }
+
+	writer_stats.queue_depth--;
+	free_requests[free_request_count++] = index;
+	pthread_cond_broadcast(&writer_cond);
+
+	pthread_mutex_unlock(&writer_lock);
+}
@@ -0,0 +1,93 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2021 Lena Voytek
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Frame Writer
+ *
+ * This module writes frames to storage asynchronously through io_uring, or a small pool of
+ * writer threads where io_uring is unavailable, so capture never waits on a slow card
+ */
+
+#ifndef FRAME_WRITER_H
+#define FRAME_WRITER_H
+
+#include <stdbool.h>
+
+#include "FramePool.h"
+
+#define FRAME_WRITER_MAX_FILES 8
+#define FRAME_WRITER_PREFIX_MAX 64
+#define FRAME_WRITER_MAX_JOBS	8
+
+/**
+ * Called from the writer once a frame write finishes, before the writer releases the frame
+ * @param frame the frame that was written
+ * @param fd the file descriptor it was written to
+ * @param result the number of bytes written, or a negative errno on failure
+ * @param context the context passed to FrameWriter_write()
+ */
+typedef void (*FRAME_WRITE_DONE)(FRAME * frame, int fd, int result, void * context);
+
+/**
+ * Slow file work, such as reserving space or syncing, run in order on the writer's job thread
+ * @param context the context passed to FrameWriter_defer()
+ */
+typedef void (*FRAME_WRITER_JOB)(void * context);
+
+typedef struct
+{
+	bool			   io_uring;
+	unsigned long	   submitted;
+	unsigned long	   completed;
+	unsigned long	   failed;
+	unsigned long	   rejected;
+	unsigned int	   queue_depth;
+	unsigned int	   max_queue_depth;
+	unsigned long long last_latency_us;
+	unsigned long long average_latency_us;
+	unsigned long long max_latency_us;
+} FRAME_WRITER_STATS;
+
+int	 FrameWriter_init(unsigned int queue_depth);
+void FrameWriter_shutdown();
+
+int	 FrameWriter_open(const char * filename);
+int	 FrameWriter_create(const char * filename);
+int	 FrameWriter_get_fd(int file);
+void FrameWriter_close(int file);
+int	 FrameWriter_defer(FRAME_WRITER_JOB job, void * context);
+
+int	 FrameWriter_write(int				file,
+					   FRAME *			frame,
+					   unsigned long long offset,
+					   FRAME_WRITE_DONE done,
+					   void *			context);
+int	 FrameWriter_write_record(int				file,
+							  const void *		prefix,
+							  unsigned int		prefix_size,
+							  FRAME *			frame,
+							  unsigned long long offset,
+							  FRAME_WRITE_DONE	done,
+							  void *			context);
+void FrameWriter_get_stats(FRAME_WRITER_STATS * stats);
+
+#endif
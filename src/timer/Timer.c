@@ -27,8 +27,26 @@
  */
 
 #include <unistd.h>
+#include <time.h>
 
 #include "Timer.h"
 
 void Timer_delay_us(unsigned int micros) { usleep(micros); }
-void Timer_delay_ms(unsigned int millis) { Timer_delay_us(millis * 1000); }
\ No newline at end of file
+void Timer_delay_ms(unsigned int millis) { Timer_delay_us(millis * 1000); }
+
+/**
+ * Get the current time from a monotonic clock
+ * @return the time in microseconds since an arbitrary fixed point
+ */
+unsigned long long Timer_now_us()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long) now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+/**
+ * Get the current time from a monotonic clock
+ * @return the time in milliseconds since an arbitrary fixed point
+ */
+unsigned long long Timer_now_ms() { return Timer_now_us() / 1000; }
@@ -33,4 +33,7 @@ void Timer_init();
 void Timer_delay_us(unsigned int micros);
 void Timer_delay_ms(unsigned int millis);
 
+unsigned long long Timer_now_us();
+unsigned long long Timer_now_ms();
+
 #endif
\ No newline at end of file